@@ -30,6 +30,7 @@ SYSCALLS = [
   entry("chdir", 1),
   entry("dup", 1),
   entry("pipe", 1),
+  entry("fsync", 1),
 ]
 
 def gen_syscall_h file
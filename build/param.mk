@@ -1,5 +1,16 @@
 KERNEL_TEST = 
 KERNEL_DEBUG =
 
+# KERNEL_WRITEBACK = 1  # Write file system blocks back by a flusher thread.
+KERNEL_WRITEBACK =      # The default writes them at the log checkpoints.
+
+KERNEL_BLOCK_SIZE = 512 # File system block size, 512 to 4096 bytes(mkfs -b).
+
+# KERNEL_BIO_POLICY = 2Q # Use 2Q buffer cache replacement.
+KERNEL_BIO_POLICY =     # The default uses LRU.
+
 KERNEL_SCHED = RR       # Use round robin task schedular.
-# KERNEL_SCHED =        # The default uses linux0.11 task schedular.
\ No newline at end of file
+# KERNEL_SCHED =        # The default uses linux0.11 task schedular.
+
+# I/O schedular selected at boot: noop, clook or deadline.
+KERNEL_IOSCHED = clook
\ No newline at end of file
@@ -35,6 +35,15 @@ endif
 ifndef KERNEL_DEBUG
 	CFLAGS += -D NDEBUG
 endif
+ifdef KERNEL_WRITEBACK
+	CFLAGS += -D KERNEL_WRITEBACK
+endif
+ifdef KERNEL_IOSCHED
+	CFLAGS += -D KERNEL_IOSCHED=\"$(strip $(KERNEL_IOSCHED))\"
+endif
+ifdef KERNEL_BLOCK_SIZE
+	CFLAGS += -D BLOCK_SIZE=$(strip $(KERNEL_BLOCK_SIZE))
+endif
 
 # $(LD) Flags
 LD_FLAGS := --gc-sections --static -nostdlib -O3
@@ -3,55 +3,214 @@
 #include "fs/log.h"
 #include "kernel/buf.h"
 #include "kernel/debug.h"
+#include "kernel/memory.h"
 #include "string.h"
 
+#include "include/balloc.h"
+
 #ifdef __cplusplus
 #if __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 #endif /* __cplusplus */
 
-static void bzero(struct disk *disk, uint32_t block_no) {
-    struct buf *buf = buf_read(disk, block_no);
-    memset(buf->data, 0, BLOCK_SIZE);
+/**
+ * Return the number of bits of the bitmap block @i.
+ */
+static inline uint32_t bmap_block_bits(struct superblock *sb, uint32_t i) {
+    uint32_t bits = sb->bmap_bytes * 8 - i * BITS_PER_BLOCK;
+    return bits > BITS_PER_BLOCK ? BITS_PER_BLOCK : bits;
+}
+
+static inline uint32_t popcount(uint32_t x) {
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
+
+/**
+ * Update the summary of the bitmap block @i by @delta free blocks.
+ */
+static void balloc_count(struct disk *disk, uint32_t i, int delta) {
+    struct balloc *ba = disk->balloc;
+    bool int_save;
+
+    spinlock_acquire(&ba->lock, &int_save);
+    ba->counts[i] += delta;
+    ba->nfree += delta;
+    spinlock_release(&ba->lock, &int_save);
+}
+
+/**
+ * Set the bit of @block_no in the bitmap block @buf and log it.
+ */
+static void balloc_mark(struct disk *disk, struct buf *buf, uint32_t block_no) {
+    uint32_t dblock_no = block_no - disk->sb->bdata_start;
+    uint32_t bit = dblock_no % BITS_PER_BLOCK;
+
+    buf->data[bit / 8] |= 1 << (bit % 8);
     log_write(disk->log, buf);
-    buf_release(buf);
+    balloc_count(disk, dblock_no / BITS_PER_BLOCK, -1);
 }
 
 /**
- * Allocate a data block and return the number of the block.
+ * Mark a free block of the bitmap allocated and return its number, or 0
+ * if there is none. A block accepted by @ok is preferred if @ok is not
+ * NULL. The free blocks following it in the same bitmap block are
+ * allocated with it, up to *@n blocks in all, and *@n is set to the number
+ * of allocated blocks.
+ *
+ * The search starts at @goal, or at the bitmap block of the last allocation
+ * if @goal is not a data block, and goes forward around the disk. It skips
+ * the bitmap blocks without free blocks and scans the others a word at a
+ * time.
  */
-uint32_t balloc(struct disk *disk) {
+static uint32_t balloc_bit(struct disk *disk, uint32_t goal, bool (*ok)(struct log *, uint32_t),
+                           uint32_t *n) {
     struct superblock *sb = disk->sb;
-    uint32_t bmap_bits = sb->bmap_bytes * 8;
-    // The disk block number of the bitmap of the data blocks.
-    uint32_t bmap_block_no = sb->bmap_start;
-    while (bmap_bits > 0) {
-        uint32_t bits = BITS_PER_BLOCK;
-        if (bits > bmap_bits) {
-            bits = bmap_bits;
+    struct balloc *ba = disk->balloc;
+    uint32_t fallback = 0;
+    uint32_t first, start;
+
+    if (goal >= sb->bdata_start && goal - sb->bdata_start < sb->bmap_bytes * 8) {
+        first = (goal - sb->bdata_start) / BITS_PER_BLOCK;
+        start = (goal - sb->bdata_start) % BITS_PER_BLOCK;
+    } else {
+        first = ba->cursor;
+        start = 0;
+    }
+
+    // The bitmap block of the goal is scanned from the goal, then again
+    // up to the goal after all others.
+    for (uint32_t k = 0; k <= ba->nbmap; k++) {
+        uint32_t i = (first + k) % ba->nbmap;
+        if (ba->counts[i] == 0 || (k == ba->nbmap && start == 0)) {
+            continue;
         }
-        struct buf *buf = buf_read(disk, bmap_block_no);
-        for (uint bit = 0; bit < bits; bit++) {
-            uint8_t m = 1 << (bit % 8);
-            if ((buf->data[bit / 8] & m) == 0) {
-                buf->data[bit / 8] |= m;
-                log_write(disk->log, buf);
-                buf_release(buf);
+
+        uint32_t bits = bmap_block_bits(sb, i);
+        uint32_t from = k == 0 ? start : 0;
+        if (k == ba->nbmap) {
+            bits = start;
+        }
+        struct buf *buf = buf_read(disk, sb->bmap_start + i);
+        uint32_t *words = (uint32_t *) buf->data;
+        for (uint32_t w = from / 32; w * 32 < bits; w++) {
+            uint32_t free = ~words[w];
+            if (w == from / 32) {
+                free &= ~0u << (from % 32);
+            }
+            for (; free != 0; free &= free - 1) {
+                uint32_t bit = w * 32 + __builtin_ctz(free);
+                if (bit >= bits) {
+                    break;
+                }
                 // The disk block number of the found data block.
-                uint32_t block_no =
-                    sb->bdata_start + (bmap_block_no - sb->bmap_start) * BITS_PER_BLOCK + bit;
-                bzero(disk, block_no);
+                uint32_t block_no = sb->bdata_start + i * BITS_PER_BLOCK + bit;
+                if (ok != NULL && !ok(disk->log, block_no)) {
+                    if (fallback == 0) {
+                        fallback = block_no;
+                    }
+                    continue;
+                }
+                balloc_mark(disk, buf, block_no);
+
+                // Extend the run.
+                uint32_t got = 1;
+                for (bit++; got < *n && bit < bits; bit++, got++) {
+                    if ((buf->data[bit / 8] & (1 << (bit % 8))) != 0 ||
+                        (ok != NULL && !ok(disk->log, block_no + got))) {
+                        break;
+                    }
+                    balloc_mark(disk, buf, block_no + got);
+                }
+                buf_release(buf);
+                ba->cursor = i;
+                *n = got;
                 return block_no;
             }
         }
+        buf_release(buf);
+    }
 
+    // Only blocks not accepted by @ok are free. Its bitmap block was not
+    // held since the fallback was found, search again if another task has
+    // taken it meanwhile.
+    if (fallback != 0) {
+        uint32_t i = (fallback - sb->bdata_start) / BITS_PER_BLOCK;
+        uint32_t bit = (fallback - sb->bdata_start) % BITS_PER_BLOCK;
+        struct buf *buf = buf_read(disk, sb->bmap_start + i);
+        bool taken = (buf->data[bit / 8] & (1 << (bit % 8))) != 0;
+        if (!taken) {
+            balloc_mark(disk, buf, fallback);
+        }
+        buf_release(buf);
+        if (taken) {
+            return balloc_bit(disk, goal, ok, n);
+        }
+    }
+    *n = 1;
+    return fallback;
+}
+
+/**
+ * Zero the @n new blocks from @block_no. The blocks are logged, unless
+ * they are file data(@data) written in place as ordered data: those are
+ * zeroed in the cache only, since the caller writes them in the same
+ * operation. They are delayed until then, so the buffers are not recycled
+ * and read back from the disk.
+ */
+static void balloc_zero(struct disk *disk, uint32_t block_no, uint32_t n, bool data) {
+    for (uint32_t i = 0; i < n; i++) {
+        struct buf *buf = buf_overwrite(disk, block_no + i);
+        memset(buf->data, 0, BLOCK_SIZE);
+        if (data && disk->log->ordered && log_block_reusable(disk->log, block_no + i)) {
+            buf_write_delayed(buf);
+        } else {
+            log_write(disk->log, buf);
+        }
         buf_release(buf);
-        bmap_bits -= bits;
-        bmap_block_no++;
     }
-    PANIC("balloc: out of blocks");
-    return 0;
+}
+
+/**
+ * Allocate up to *@n contiguous blocks near @goal. Return the number of
+ * the first block and set *@n to the number of allocated blocks.
+ */
+uint32_t balloc_run(struct disk *disk, uint32_t goal, uint32_t *n) {
+    uint32_t block_no = balloc_bit(disk, goal, NULL, n);
+    if (block_no == 0) {
+        PANIC("balloc: out of blocks");
+    }
+    balloc_zero(disk, block_no, *n, false);
+    return block_no;
+}
+
+/**
+ * Allocate up to *@n contiguous blocks for file data near @goal,
+ * preferring the blocks that can be written in place as ordered data.
+ */
+uint32_t balloc_data_run(struct disk *disk, uint32_t goal, uint32_t *n) {
+    uint32_t block_no = balloc_bit(disk, goal, log_block_reusable, n);
+    if (block_no == 0) {
+        PANIC("balloc: out of blocks");
+    }
+    balloc_zero(disk, block_no, *n, true);
+    return block_no;
+}
+
+/**
+ * Allocate a data block near @goal and return the number of the block.
+ */
+uint32_t balloc(struct disk *disk, uint32_t goal) {
+    uint32_t n = 1;
+    return balloc_run(disk, goal, &n);
+}
+
+uint32_t balloc_data(struct disk *disk, uint32_t goal) {
+    uint32_t n = 1;
+    return balloc_data_run(disk, goal, &n);
 }
 
 /**
@@ -73,38 +232,140 @@ void bfree(struct disk *disk, uint32_t dblock_no) {
     buf->data[bits / 8] &= ~m;
     log_write(disk->log, buf);
     buf_release(buf);
+    balloc_count(disk, dblock_no / BITS_PER_BLOCK, 1);
+    log_block_freed(disk->log, sb->bdata_start + dblock_no);
 }
 
-#ifdef KERNEL_TEST
-uint32_t get_free_data_blocks(struct disk *disk) {
+/**
+ * Return the number of bits of the inode bitmap block @i.
+ */
+static inline uint32_t imap_block_bits(struct superblock *sb, uint32_t i) {
+    uint32_t bits = sb->ninodes - i * BITS_PER_BLOCK;
+    return bits > BITS_PER_BLOCK ? BITS_PER_BLOCK : bits;
+}
+
+static void ialloc_count(struct disk *disk, uint32_t i, int delta) {
+    struct balloc *ba = disk->balloc;
+    bool int_save;
+
+    spinlock_acquire(&ba->lock, &int_save);
+    ba->icounts[i] += delta;
+    ba->nifree += delta;
+    spinlock_release(&ba->lock, &int_save);
+}
+
+/**
+ * The search starts at the inode bitmap block of the last allocation and
+ * skips the full blocks, so it reads one bitmap block unless the summary
+ * is stale.
+ */
+uint32_t ialloc(struct disk *disk) {
     struct superblock *sb = disk->sb;
-    struct buf *buf;
-    uint32_t free_data_blocks = 0;
-
-    uint32_t bmap_bits = sb->bmap_bytes * 8;
-    uint32_t bmap_block_no = sb->bmap_start;
-    while (bmap_bits > 0) {
-        uint32_t bits = BITS_PER_BLOCK;
-        if (bits > bmap_bits) {
-            bits = bmap_bits;
+    struct balloc *ba = disk->balloc;
+
+    for (uint32_t k = 0; k < ba->nimap; k++) {
+        uint32_t i = (ba->icursor + k) % ba->nimap;
+        if (ba->icounts[i] == 0) {
+            continue;
         }
 
-        buf = buf_read(disk, bmap_block_no);
-        for (uint bit = 0; bit < bits; bit++) {
-            uint8_t m = 1 << (bit % 8);
-            if ((buf->data[bit / 8] & m) == 0) {
-                free_data_blocks++;
+        uint32_t bits = imap_block_bits(sb, i);
+        struct buf *buf = buf_read(disk, sb->imap_start + i);
+        uint32_t *words = (uint32_t *) buf->data;
+        for (uint32_t w = 0; w * 32 < bits; w++) {
+            if (words[w] == ~0u) {
+                continue;
             }
+            uint32_t bit = w * 32 + __builtin_ctz(~words[w]);
+            if (bit >= bits) {
+                break;
+            }
+            buf->data[bit / 8] |= 1 << (bit % 8);
+            log_write(disk->log, buf);
+            buf_release(buf);
+            ialloc_count(disk, i, -1);
+            ba->icursor = i;
+            return i * BITS_PER_BLOCK + bit;
         }
-
         buf_release(buf);
-        bmap_bits -= bits;
-        bmap_block_no++;
     }
 
-    return free_data_blocks;
+    PANIC("ialloc: no inodes.");
+    return 0;
+}
+
+void ifree(struct disk *disk, uint32_t inum) {
+    struct superblock *sb = disk->sb;
+    uint32_t bit = inum % BITS_PER_BLOCK;
+    uint8_t m = 1 << (bit % 8);
+    struct buf *buf;
+
+    ASSERT(inum != 0 && inum < sb->ninodes);
+    buf = buf_read(disk, sb->imap_start + inum / BITS_PER_BLOCK);
+    ASSERT((buf->data[bit / 8] & m) != 0);
+    buf->data[bit / 8] &= ~m;
+    log_write(disk->log, buf);
+    buf_release(buf);
+    ialloc_count(disk, inum / BITS_PER_BLOCK, 1);
+}
+
+uint32_t get_free_data_blocks(struct disk *disk) {
+    return disk->balloc->nfree;
+}
+
+uint32_t get_free_inodes(struct disk *disk) {
+    return disk->balloc->nifree;
+}
+
+/**
+ * Return the number of clear bits among the first @bits bits of the
+ * bitmap block @block_no.
+ */
+static uint32_t bitmap_count_free(struct disk *disk, uint32_t block_no, uint32_t bits) {
+    struct buf *buf = buf_read(disk, block_no);
+    uint32_t *words = (uint32_t *) buf->data;
+    uint32_t used = 0;
+
+    for (uint32_t w = 0; w * 32 < bits; w++) {
+        uint32_t word = words[w];
+        if (bits - w * 32 < 32) {
+            word |= ~0u << (bits - w * 32);
+        }
+        used += popcount(word);
+    }
+    buf_release(buf);
+    return bits - used;
+}
+
+void balloc_init(struct disk *disk) {
+    struct superblock *sb = disk->sb;
+    struct balloc *ba = kalloc(sizeof *ba);
+
+    spinlock_init(&ba->lock);
+    ba->nbmap = ROUND_UP(sb->bmap_bytes, BLOCK_SIZE);
+    ba->nfree = 0;
+    ba->cursor = 0;
+    ASSERT(ba->nbmap * sizeof *ba->counts < PG_SIZE);
+    ba->counts = kalloc(ba->nbmap * sizeof *ba->counts);
+
+    // Count the free blocks of each bitmap block.
+    for (uint32_t i = 0; i < ba->nbmap; i++) {
+        ba->counts[i] = bitmap_count_free(disk, sb->bmap_start + i, bmap_block_bits(sb, i));
+        ba->nfree += ba->counts[i];
+    }
+
+    ba->nimap = ROUND_UP(sb->ninodes, BITS_PER_BLOCK);
+    ba->nifree = 0;
+    ba->icursor = 0;
+    ASSERT(ba->nimap * sizeof *ba->icounts < PG_SIZE);
+    ba->icounts = kalloc(ba->nimap * sizeof *ba->icounts);
+
+    for (uint32_t i = 0; i < ba->nimap; i++) {
+        ba->icounts[i] = bitmap_count_free(disk, sb->imap_start + i, imap_block_bits(sb, i));
+        ba->nifree += ba->icounts[i];
+    }
+    disk->balloc = ba;
 }
-#endif /* KERNEL_TEST */
 
 #ifdef __cplusplus
 #if __cplusplus
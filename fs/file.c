@@ -16,6 +16,10 @@ extern "C" {
 
 #define NFILES 50
 
+// Read-ahead window limits (blocks).
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 64
+
 static struct {
     struct file files[NFILES];
     struct spinlock lock;
@@ -74,7 +78,7 @@ void file_close(struct file *f) {
     spinlock_release(&ftable.lock, &int_save);
 
     if (typ == FD_INODE) {
-        log_begin_op(ip->disk->log);
+        log_begin_op(ip->disk->log, LOG_BUDGET_PUT);
         inode_put(ip);
         log_end_op(ip->disk->log);
     } else if (typ == FD_PIPE) {
@@ -91,6 +95,44 @@ struct file *file_dup(struct file *f) {
     return f;
 }
 
+/**
+ * Read ahead the blocks following the @n bytes just read at @f->offset if
+ * @f is being read sequentially. The window doubles on every sequential
+ * read and is capped by the recent read-ahead hit rate.
+ *
+ * Caller must hold @f->inode->lock.
+ */
+static void file_readahead(struct file *f, uint32_t n) {
+    uint32_t next = f->offset + n;
+
+    if (f->offset != f->ra_next) {
+        // Random access, stop reading ahead.
+        f->ra_next = next;
+        f->ra_window = 0;
+        f->ra_end = 0;
+        return;
+    }
+    f->ra_next = next;
+
+    uint32_t window = f->ra_window == 0 ? RA_MIN_BLOCKS : f->ra_window * 2;
+    uint32_t max = buf_readahead_window(RA_MAX_BLOCKS);
+    if (window > max) {
+        window = max;
+    }
+    f->ra_window = window;
+
+    // Only issue the blocks that have not been read ahead yet.
+    uint32_t start = ROUND_UP(next, BLOCK_SIZE);
+    uint32_t end = next / BLOCK_SIZE + window;
+    if (start < f->ra_end) {
+        start = f->ra_end;
+    }
+    if (start < end) {
+        inode_readahead(f->inode, start, end - start);
+        f->ra_end = end;
+    }
+}
+
 int file_read(struct file *f, void *dst, uint32_t n) {
 
     if (!f->readable) {
@@ -102,6 +144,7 @@ int file_read(struct file *f, void *dst, uint32_t n) {
             inode_lock(f->inode);
             int r = inode_read(f->inode, dst, f->offset, n);
             if (r > 0) {
+                file_readahead(f, r);
                 f->offset += r;
             }
             inode_unlock(f->inode);
@@ -128,27 +171,32 @@ int file_write(struct file *f, void *src, uint32_t n) {
         case FD_INODE: {
             int r;
             uint32_t i;
-            uint32_t max = ((MAX_OPEN_BLOCKS - 4) / 2) * BLOCK_SIZE;
 
             for (i = 0; i < n; i += r) {
+                struct log *log = f->inode->disk->log;
+                log_begin_op(log, LOG_BUDGET_WRITE);
+                inode_lock(f->inode);
+
+                // Besides the data blocks, which are logged unless they are
+                // ordered data, the chunk writes the inode, 2 indirect blocks
+                // per level and 2 bitmap blocks at most.
+                uint32_t meta = 3 + 2 * NINDIRECT_LEVELS;
+                uint32_t max = (log_budget_left(log) - meta) * BLOCK_SIZE - f->offset % BLOCK_SIZE;
                 uint32_t n1 = n - i;
                 if (n1 > max) {
                     n1 = max;
                 }
 
-                log_begin_op(f->inode->disk->log);
-                inode_lock(f->inode);
                 if ((r = inode_write(f->inode, src, f->offset, n1)) > 0) {
                     f->offset += r;
                 }
                 inode_unlock(f->inode);
-                log_end_op(f->inode->disk->log);
+                log_end_op(log);
 
-                if (r < 0) {
+                // A short write leaves no room for more.
+                if (r < 0 || (uint) r < n1) {
                     break;
                 }
-
-                ASSERT((uint) r == n1);
             }
 
             return i == n ? 0 : -1;
@@ -10,49 +10,38 @@
 #include "kernel/memory.h"
 #include "string.h"
 
+#include "include/balloc.h"
 #include "include/inode.h"
 #include "include/superblock.h"
 
-uint32_t get_free_inodes(struct disk *disk) {
-    struct superblock *sb;
-    struct buf *buf;
-    struct dinode *dip;
-    uint32_t inum, free_inodes;
-
-    sb = disk->sb;
-    free_inodes = 0;
-
-    // inum = 1: inum 0 is the NULL inode.
-    for (inum = 1; inum < sb->ninodes; inum++) {
-        buf = buf_read(disk, GET_INODE_BLOCK_NO(inum, *sb));
-        dip = (struct dinode *) buf->data + (inum % INODES_PER_BLOCK);
-        if (dip->type == INODE_NONE) {
-            free_inodes++;
-        }
-        buf_release(buf);
-    }
-
-    return free_inodes;
-}
-
 static void scan_fs(struct disk *disk) {
     struct buf *buf;
     struct superblock *sb;
 
-    // Read super block from disk.
-    buf = buf_read(disk, LBA_TO_BLOCK_NO(1));
-    sb = (struct superblock *) buf->data;
+    // Read super block from disk, a block may hold the boot sector too.
+    buf = buf_read(disk, LBA_TO_BLOCK_NO(SUPER_BLOCK_LBA));
+    sb = (struct superblock *) (buf->data + SUPER_BLOCK_LBA * SECTOR_SIZE % BLOCK_SIZE);
 
+    if (sb->magic == SUPER_BLOCK_MAGIC_OLD) {
+        PANIC("Disk %s: file system of an old format, make it again with mkfs.\n", disk->name);
+    }
     if (sb->magic != SUPER_BLOCK_MAGIC) {
         PANIC("Disk %s: no file system.\n", disk->name);
     }
+    if (sb->block_size != BLOCK_SIZE) {
+        PANIC("Disk %s: block size %d, the kernel is built for %d.\n", disk->name,
+              sb->block_size, BLOCK_SIZE);
+    }
 
     disk->sb = kalloc(sizeof *disk->sb);
     memcpy(disk->sb, sb, sizeof *sb);
     disk->log = kalloc(sizeof *disk->log);
-    log_init(disk->log, disk, disk->sb->log_start);
+    log_init(disk->log, disk, disk->sb->log_start, disk->sb->nlog);
+    balloc_init(disk);
 
     buf_release(buf);
+
+    inode_reclaim_orphans(disk);
 }
 
 void fs_init() {
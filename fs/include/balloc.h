@@ -2,6 +2,7 @@
 #define _BALLOC_H
 
 #include "kernel/ide.h"
+#include "kernel/spinlock.h"
 #include "stdint.h"
 
 #ifdef __cplusplus
@@ -10,9 +11,48 @@ extern "C" {
 #endif /* __cplusplus */
 #endif /* __cplusplus */
 
-uint32_t balloc(struct disk *disk);
+/**
+ * In-memory summary of the bitmaps of the data blocks and of the inodes
+ * of a disk.
+ */
+struct balloc {
+    struct spinlock lock;
+    uint32_t nbmap;   // Number of bitmap blocks.
+    uint32_t nfree;   // Number of free data blocks.
+    uint32_t cursor;  // Bitmap block where the next search starts.
+    uint16_t *counts; // Free data blocks of each bitmap block.
+
+    uint32_t nimap;    // Number of inode bitmap blocks.
+    uint32_t nifree;   // Number of free inodes.
+    uint32_t icursor;  // Inode bitmap block where the next search starts.
+    uint16_t *icounts; // Free inodes of each inode bitmap block.
+};
+
+/**
+ * Build the summary of the bitmaps of @disk.
+ */
+void balloc_init(struct disk *disk);
+
+/**
+ * Allocate a block near @goal, 0 if there is no goal.
+ */
+uint32_t balloc(struct disk *disk, uint32_t goal);
+uint32_t balloc_data(struct disk *disk, uint32_t goal);
+
+/**
+ * Allocate up to *@n contiguous blocks near @goal, *@n is set to the
+ * number of allocated blocks.
+ */
+uint32_t balloc_run(struct disk *disk, uint32_t goal, uint32_t *n);
+uint32_t balloc_data_run(struct disk *disk, uint32_t goal, uint32_t *n);
 void bfree(struct disk *disk, uint32_t dblock_no);
 
+/**
+ * Mark a free inode allocated in the inode bitmap and return its number.
+ */
+uint32_t ialloc(struct disk *disk);
+void ifree(struct disk *disk, uint32_t inum);
+
 #ifdef __cplusplus
 #if __cplusplus
 }
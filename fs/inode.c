@@ -5,6 +5,7 @@
 #include "fs/log.h"
 #include "fs/pathname.h"
 #include "kernel/buf.h"
+#include "kernel/memory.h"
 #include "string.h"
 
 #include "include/balloc.h"
@@ -17,95 +18,411 @@ extern "C" {
 #endif /* __cplusplus */
 #endif /* __cplusplus */
 
-#define NINODES 50 // Maximum number of active inodes.
+/**
+ * The inode cache indexes the in-memory inodes by (disk, inum) in a hash
+ * table. An inode whose last reference is dropped stays in the table with
+ * its disk_inode and goes to the tail of icache.lru, so that a later
+ * iget() of the same inode does not read it again. New inodes recycle the
+ * head of icache.lru, the least recently used one.
+ *
+ * The cache grows a page of inodes at a time on misses until it reaches
+ * icache.target_inodes, 1/ICACHE_MEM_RATIO of the main memory.
+ *
+ * An unlinked inode is not freed by the inode_put() dropping its last
+ * reference, whose caller may hold other inodes locked, but goes to
+ * icache.orphans with that reference. inode_reclaim() frees the orphans
+ * when the operation ends. The unlinked inodes left by a crash, before or
+ * while they were freed, are found at mount by inode_reclaim_orphans().
+ */
+extern uint32_t get_total_memory();
+
+#define NINODES_MIN       50 // Minimum number of cached inodes.
+#define ICACHE_MEM_RATIO  256
+#define INODES_PER_PAGE   (PG_SIZE / sizeof(struct inode))
+#define IBUCKETS_PER_PAGE (PG_SIZE / sizeof(struct inode *))
 
 struct {
     struct spinlock lock;
-    struct inode inodes[NINODES + 1];
+    struct list lru;        // Unreferenced inodes, least recently used first.
+    struct list orphans;    // Unlinked inodes to free, see inode_reclaim().
+    bool reclaiming;        // Is a task freeing the orphans?
+    uint32_t ninodes;       // Number of inodes in the cache.
+    uint32_t target_inodes; // The cache grows up to this size on misses.
+
+    struct inode **buckets;
+    uint32_t nbuckets; // Number of hash buckets (a power of 2).
+
+    struct icache_stats stats;
 } icache;
 
+static inline struct inode **inode_bucket(struct disk *disk, uint32_t inum) {
+    return &icache.buckets[(((uint32_t) disk >> 4) ^ inum) & (icache.nbuckets - 1)];
+}
+
+static inline void inode_hash_insert(struct inode *ip) {
+    struct inode **bucket = inode_bucket(ip->disk, ip->inum);
+    ip->hnext = *bucket;
+    *bucket = ip;
+}
+
+static inline void inode_hash_remove(struct inode *ip) {
+    struct inode **pp = inode_bucket(ip->disk, ip->inum);
+    while (*pp != NULL) {
+        if (*pp == ip) {
+            *pp = ip->hnext;
+            ip->hnext = NULL;
+            return;
+        }
+        pp = &(*pp)->hnext;
+    }
+}
+
+static inline struct inode *inode_hash_lookup(struct disk *disk, uint32_t inum) {
+    struct inode *ip;
+    for (ip = *inode_bucket(disk, inum); ip != NULL; ip = ip->hnext) {
+        if (ip->disk == disk && ip->inum == inum) {
+            return ip;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add a page of new inodes to the head of icache.lru.
+ *
+ * Return false if there is no memory.
+ */
+static bool icache_grow() {
+    struct inode *inodes;
+    bool int_save;
+
+    if ((inodes = get_free_page()) == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < INODES_PER_PAGE; i++) {
+        struct inode *ip = &inodes[i];
+        ip->disk = NULL;
+        ip->inum = 0;
+        ip->ref = 0;
+        ip->hnext = NULL;
+        ip->valid = false;
+        ip->disk_inode.type = INODE_NONE;
+        sem_init(&ip->sem, 1, "inode");
+    }
+
+    spinlock_acquire(&icache.lock, &int_save);
+    for (uint32_t i = 0; i < INODES_PER_PAGE; i++) {
+        list_offer(&icache.lru, &inodes[i].lru);
+    }
+    icache.ninodes += INODES_PER_PAGE;
+    spinlock_release(&icache.lock, &int_save);
+    return true;
+}
+
 void inodes_init() {
     spinlock_init(&icache.lock);
-    for (int i = 0; i < NINODES; i++) {
-        icache.inodes[i].ref = 0;
-        icache.inodes[i].disk_inode.type = INODE_NONE;
-        icache.inodes[i].valid = false;
-        icache.inodes[i].inum = 0;
-        sem_init(&icache.inodes[i].sem, 1, "inode");
+    list_init(&icache.lru);
+    list_init(&icache.orphans);
+    icache.reclaiming = false;
+    memset(&icache.stats, 0, sizeof icache.stats);
+    icache.ninodes = 0;
+
+    icache.target_inodes = get_total_memory() / ICACHE_MEM_RATIO / sizeof(struct inode);
+    if (icache.target_inodes < NINODES_MIN) {
+        icache.target_inodes = NINODES_MIN;
+    }
+
+    // About two inodes per hash bucket once the cache is full.
+    icache.nbuckets = 1;
+    while (icache.nbuckets * 2 < icache.target_inodes && icache.nbuckets < IBUCKETS_PER_PAGE) {
+        icache.nbuckets <<= 1;
+    }
+    if ((icache.buckets = get_zeroed_free_page()) == NULL) {
+        PANIC("inodes_init: no memory for the hash table");
+    }
+
+    while (icache.ninodes < NINODES_MIN) {
+        if (!icache_grow()) {
+            PANIC("inodes_init: no memory for inodes");
+        }
     }
 }
 
-struct inode *iget(struct disk *disk, uint32_t inum) {
+void icache_get_stats(struct icache_stats *stats) {
+    bool int_save;
+    spinlock_acquire(&icache.lock, &int_save);
+    *stats = icache.stats;
+    stats->ninodes = icache.ninodes;
+    spinlock_release(&icache.lock, &int_save);
+}
 
-    struct inode *ip, *empty;
+struct inode *iget(struct disk *disk, uint32_t inum) {
+    struct inode *ip;
     bool int_save;
+    bool grown = false;
 
     spinlock_acquire(&icache.lock, &int_save);
-
-    empty = NULL;
-    for (ip = &icache.inodes[0]; ip < &icache.inodes[NINODES]; ip++) {
-        if (ip->ref > 0 && ip->disk == disk && ip->inum == inum) {
-            ip->ref++;
+    icache.stats.lookups++;
+
+    for (;;) {
+        if ((ip = inode_hash_lookup(disk, inum)) != NULL) {
+            icache.stats.hits++;
+            if (ip->ref++ == 0) {
+                list_unlinked(&ip->lru);
+                icache.stats.reuses++;
+            }
             spinlock_release(&icache.lock, &int_save);
             return ip;
         }
 
-        if (empty == NULL && ip->ref == 0) {
-            empty = ip;
+        // Grow the cache instead of recycling an inode until the target
+        // size is reached, or when all inodes are in use.
+        if (list_empty(&icache.lru) || (!grown && icache.ninodes < icache.target_inodes)) {
+            spinlock_release(&icache.lock, &int_save);
+            grown = icache_grow();
+            spinlock_acquire(&icache.lock, &int_save);
+            if (grown) {
+                continue;
+            }
+            if (list_empty(&icache.lru)) {
+                PANIC("iget: no inodes");
+            }
+        }
+
+        ip = NODE_AS(struct inode, LIST_FIRST(&icache.lru), lru);
+        list_unlinked(&ip->lru);
+        if (ip->disk != NULL) {
+            inode_hash_remove(ip);
         }
+        ip->disk = disk;
+        ip->inum = inum;
+        ip->ref = 1;
+        ip->valid = false;
+        inode_hash_insert(ip);
+
+        spinlock_release(&icache.lock, &int_save);
+        return ip;
     }
+}
 
-    ASSERT(empty != NULL);
+/**
+ * Make sure the operation can log the next step of itruncate(), which
+ * frees a block at the indirection @depth(0: a direct block) together with
+ * the indirect blocks emptied by it, and clears their pointers: a bitmap
+ * block and a pointer block per level. ITRUNCATE_FINAL blocks are kept for
+ * the last step, which writes the inode and frees it in the inode bitmap.
+ *
+ * The operation is restarted when its budget is too low, so a large file is
+ * freed by several transactions. Each step leaves the inode consistent.
+ * The caller holds no lock but the one of @ip, see inode_reclaim().
+ */
+#define ITRUNCATE_FINAL 2
+
+static void itruncate_reserve(struct inode *ip, int depth) {
+    struct log *log = ip->disk->log;
+
+    if (log_budget_left(log) < 2 * (depth + 1) + ITRUNCATE_FINAL) {
+        inode_update(ip);
+        log_end_op(log);
+        log_begin_op(log, LOG_BUDGET_MAX);
+    }
+}
 
-    ip = empty;
-    ip->disk = disk;
-    ip->inum = inum;
-    ip->ref = 1;
-    ip->valid = false;
+/**
+ * Free the tree of the indirect block @addr, whose entries point to blocks
+ * @level - 1 levels above the data blocks, and the block itself. The
+ * caller clears the pointer to @addr in the same step.
+ */
+static void itruncate_tree(struct inode *ip, uint32_t addr, int level, int depth) {
+    struct disk *disk = ip->disk;
+    struct buf *buf;
 
-    spinlock_release(&icache.lock, &int_save);
-    return ip;
+    for (uint32_t i = 0; i < NINDIRECT_DATA_BLOCKS; i++) {
+        buf = buf_read(disk, addr);
+        uint32_t child = ((uint32_t *) buf->data)[i];
+        buf_release(buf);
+        if (child == 0) {
+            continue;
+        }
+
+        itruncate_reserve(ip, depth);
+        if (level > 1) {
+            itruncate_tree(ip, child, level - 1, depth);
+        } else {
+            bfree(disk, child);
+        }
+        buf = buf_read(disk, addr);
+        ((uint32_t *) buf->data)[i] = 0;
+        log_write(disk->log, buf);
+        buf_release(buf);
+    }
+    bfree(disk, addr);
+}
+
+/**
+ * A leaf of the extents of an inode: the inode itself, the extent block, or
+ * an extent block of the index.
+ */
+struct eleaf {
+    struct extent *ext; // The extents.
+    uint32_t n;         // Number of extents.
+    uint32_t max;       // Room for extents.
+    int slot;           // Entry of the leaf in the index, -1 without index.
+    struct buf *buf;    // Buffer of the extent block, NULL for the inode.
+    struct buf *ibuf;   // Buffer of the index block, NULL without index.
+};
+
+/**
+ * Get the leaf of the extents of @ip mapping the block @bn, the last one if
+ * @bn is past the extents.
+ */
+static void eleaf_get(struct inode *ip, uint32_t bn, struct eleaf *leaf) {
+    struct dinode *dp = &ip->disk_inode;
+
+    leaf->slot = -1;
+    leaf->buf = leaf->ibuf = NULL;
+    leaf->n = dp->nextents;
+    if (dp->eblock == 0) {
+        leaf->ext = dp->extents;
+        leaf->max = NINODE_EXTENTS;
+        return;
+    }
+
+    uint32_t block = dp->eblock;
+    if (dp->flags & INODE_FLAGS_EINDEX) {
+        leaf->ibuf = buf_read(ip->disk, dp->eblock);
+        struct extent *idx = (struct extent *) leaf->ibuf->data;
+        int i = dp->nextents - 1;
+        while (i > 0 && bn < idx[i].lblock) {
+            i--;
+        }
+        leaf->slot = i;
+        leaf->n = idx[i].len;
+        block = idx[i].pblock;
+    }
+    leaf->buf = buf_read(ip->disk, block);
+    leaf->ext = (struct extent *) leaf->buf->data;
+    leaf->max = NBLOCK_EXTENTS;
+}
+
+/**
+ * Release the leaf, and store its number of extents and log its blocks if
+ * it is @dirty.
+ */
+static void eleaf_put(struct inode *ip, struct eleaf *leaf, bool dirty) {
+    struct log *log = ip->disk->log;
+
+    if (dirty) {
+        if (leaf->slot < 0) {
+            ip->disk_inode.nextents = leaf->n;
+        } else {
+            ((struct extent *) leaf->ibuf->data)[leaf->slot].len = leaf->n;
+            log_write(log, leaf->ibuf);
+        }
+        if (leaf->buf != NULL) {
+            log_write(log, leaf->buf);
+        }
+    }
+    if (leaf->buf != NULL) {
+        buf_release(leaf->buf);
+    }
+    if (leaf->ibuf != NULL) {
+        buf_release(leaf->ibuf);
+    }
+}
+
+/**
+ * Free the extents from the last block on, one block per step, and the
+ * extent blocks once they are empty.
+ */
+static void itruncate_extents(struct inode *ip) {
+    struct dinode *dp = &ip->disk_inode;
+    struct eleaf leaf;
+
+    while (dp->nextents > 0) {
+        itruncate_reserve(ip, 1);
+        eleaf_get(ip, MAX_DATA_BLOCKS, &leaf);
+        if (leaf.n > 0) {
+            struct extent *ext = &leaf.ext[leaf.n - 1];
+            bfree(ip->disk, ext->pblock + --ext->len);
+            if (ext->len == 0) {
+                leaf.n--;
+            }
+        }
+        if (leaf.n == 0 && leaf.slot >= 0) {
+            bfree(ip->disk, leaf.buf->block_no);
+            buf_release(leaf.buf);
+            leaf.buf = NULL;
+            dp->nextents--;
+        }
+        eleaf_put(ip, &leaf, true);
+    }
+    if (dp->eblock != 0) {
+        bfree(ip->disk, dp->eblock);
+        dp->eblock = 0;
+        dp->flags &= ~INODE_FLAGS_EINDEX;
+    }
 }
 
 static void itruncate(struct inode *ip) {
     struct dinode *dp;
     struct disk *disk;
-    struct buf *buf;
-    uint32_t *addrs;
 
     dp = &ip->disk_inode;
     disk = ip->disk;
+    if (dp->flags & INODE_FLAGS_EXTENTS) {
+        itruncate_extents(ip);
+        dp->size = 0;
+        inode_update(ip);
+        return;
+    }
+
     for (int i = 0; i < NDIRECT_DATA_BLOCKS; i++) {
         if (dp->addrs[i] != 0) {
+            itruncate_reserve(ip, 0);
             bfree(disk, dp->addrs[i]);
             dp->addrs[i] = 0;
         }
     }
 
-    if (dp->addrs[NDIRECT_DATA_BLOCKS] != 0) {
-        buf = buf_read(disk, dp->addrs[NDIRECT_DATA_BLOCKS]);
-        addrs = (uint32_t *) buf->data;
-        for (uint i = 0; i < NINDIRECT_DATA_BLOCKS; i++) {
-            if (addrs[i] != 0) {
-                bfree(disk, addrs[i]);
-                addrs[i] = 0;
-            }
+    for (int level = 1; level <= NINDIRECT_LEVELS; level++) {
+        int root = NDIRECT_DATA_BLOCKS + level - 1;
+        if (dp->addrs[root] != 0) {
+            itruncate_tree(ip, dp->addrs[root], level, level);
+            dp->addrs[root] = 0;
         }
-        log_write(disk->log, buf);
-        buf_release(buf);
-        bfree(disk, dp->addrs[NDIRECT_DATA_BLOCKS]);
     }
 
     dp->size = 0;
     inode_update(ip);
 }
 
+/**
+ * Allocate a block of the inode near @goal. The blocks of a file are
+ * allocated as ordered data.
+ */
+static uint32_t bmap_alloc(struct inode *ip, uint32_t goal) {
+    if (ip->disk_inode.type == INODE_FILE) {
+        return balloc_data(ip->disk, goal);
+    }
+    return balloc(ip->disk, goal);
+}
+
+/**
+ * The goal for a new block is the block following the previous block of the
+ * inode, so that a file written sequentially is contiguous on the disk.
+ */
+static inline uint32_t bmap_goal(uint32_t prev) {
+    return prev == 0 ? 0 : prev + 1;
+}
+
 static uint32_t bmap(struct inode *ip, uint32_t bn) {
     struct buf *buf;
     struct disk *disk;
     struct dinode *dp;
-    uint32_t addr;
+    uint32_t addr, prev, span;
     uint32_t *indirect_addrs;
+    int level;
     ASSERT(bn < MAX_DATA_BLOCKS);
 
     disk = ip->disk;
@@ -113,50 +430,214 @@ static uint32_t bmap(struct inode *ip, uint32_t bn) {
 
     if (bn < NDIRECT_DATA_BLOCKS) {
         if ((addr = dp->addrs[bn]) == 0) {
-            dp->addrs[bn] = addr = balloc(disk);
+            prev = bn > 0 ? dp->addrs[bn - 1] : 0;
+            dp->addrs[bn] = addr = bmap_alloc(ip, bmap_goal(prev));
         }
         return addr;
     }
 
+    // Find the indirect tree of the block, a tree of @level levels maps
+    // @span blocks.
     bn -= NDIRECT_DATA_BLOCKS;
-    if (dp->addrs[NDIRECT_DATA_BLOCKS] == 0) {
-        dp->addrs[NDIRECT_DATA_BLOCKS] = balloc(disk);
+    level = 1;
+    span = NINDIRECT_DATA_BLOCKS;
+    while (bn >= span) {
+        bn -= span;
+        span *= NINDIRECT_DATA_BLOCKS;
+        level++;
     }
-    buf = buf_read(disk, dp->addrs[NDIRECT_DATA_BLOCKS]);
-    indirect_addrs = (uint32_t *) buf->data;
-    if ((addr = indirect_addrs[bn]) == 0) {
-        indirect_addrs[bn] = addr = balloc(disk);
-        log_write(disk->log, buf);
+
+    int root = NDIRECT_DATA_BLOCKS + level - 1;
+    if (dp->addrs[root] == 0) {
+        prev = dp->addrs[root - 1];
+        dp->addrs[root] = balloc(disk, bmap_goal(prev));
+    }
+
+    // Walk down the tree, allocating the missing blocks.
+    addr = dp->addrs[root];
+    for (; level > 0; level--) {
+        span /= NINDIRECT_DATA_BLOCKS;
+        uint32_t i = bn / span;
+        bn %= span;
+
+        buf = buf_read(disk, addr);
+        indirect_addrs = (uint32_t *) buf->data;
+        if (indirect_addrs[i] == 0) {
+            prev = i > 0 ? indirect_addrs[i - 1] : addr;
+            if (level == 1) {
+                indirect_addrs[i] = bmap_alloc(ip, bmap_goal(prev));
+            } else {
+                indirect_addrs[i] = balloc(disk, bmap_goal(prev));
+            }
+            log_write(disk->log, buf);
+        }
+        addr = indirect_addrs[i];
+        buf_release(buf);
     }
-    buf_release(buf);
 
     return addr;
 }
 
+/**
+ * Replace the full last leaf of the extents of @ip by a new empty one for
+ * the blocks from @bn: the extents of the inode move to an extent block,
+ * and a new extent block is added to the index, which replaces the single
+ * extent block first. Return false if the index is full.
+ */
+static bool emap_grow(struct inode *ip, struct eleaf *leaf, uint32_t bn) {
+    struct dinode *dp = &ip->disk_inode;
+    struct disk *disk = ip->disk;
+
+    if (leaf->buf == NULL) {
+        uint32_t eblock = balloc(disk, 0);
+        leaf->buf = buf_read(disk, eblock);
+        memcpy(leaf->buf->data, dp->extents, sizeof dp->extents);
+        memset(dp->extents, 0, sizeof dp->extents);
+        dp->eblock = eblock;
+        leaf->ext = (struct extent *) leaf->buf->data;
+        leaf->max = NBLOCK_EXTENTS;
+        return true;
+    }
+
+    if (leaf->ibuf == NULL) {
+        uint32_t iblock = balloc(disk, 0);
+        leaf->ibuf = buf_read(disk, iblock);
+        struct extent *idx = (struct extent *) leaf->ibuf->data;
+        idx[0].lblock = leaf->ext[0].lblock;
+        idx[0].pblock = dp->eblock;
+        idx[0].len = leaf->n;
+        dp->eblock = iblock;
+        dp->nextents = 1;
+        dp->flags |= INODE_FLAGS_EINDEX;
+    } else if (dp->nextents == NBLOCK_EXTENTS) {
+        return false;
+    }
+
+    // The full leaf is not changed.
+    buf_release(leaf->buf);
+    uint32_t eblock = balloc(disk, 0);
+    struct extent *idx = (struct extent *) leaf->ibuf->data;
+    leaf->slot = dp->nextents++;
+    idx[leaf->slot].lblock = bn;
+    idx[leaf->slot].pblock = eblock;
+    idx[leaf->slot].len = 0;
+    leaf->buf = buf_read(disk, eblock);
+    leaf->ext = (struct extent *) leaf->buf->data;
+    leaf->n = 0;
+    return true;
+}
+
+/**
+ * Append the run of @n blocks allocated at @addr for the blocks from @bn to
+ * the last leaf of the extents of @ip, and return false if there is no room
+ * for a new extent.
+ */
+static bool emap_append(struct inode *ip, struct eleaf *leaf, uint32_t bn, uint32_t addr,
+                        uint32_t n) {
+    struct extent *last = leaf->n > 0 ? &leaf->ext[leaf->n - 1] : NULL;
+
+    if (last != NULL && bn == last->lblock + last->len && addr == last->pblock + last->len) {
+        last->len += n;
+        return true;
+    }
+    if (leaf->n == leaf->max && !emap_grow(ip, leaf, bn)) {
+        return false;
+    }
+
+    struct extent *e = &leaf->ext[leaf->n++];
+    e->lblock = bn;
+    e->pblock = addr;
+    e->len = n;
+    return true;
+}
+
+/**
+ * The block mapping of an extent-mapped inode. Return the disk block of the
+ * block @bn of @ip and set *@n to the number of blocks from @bn on, at most
+ * *@n, that follow it on the disk.
+ *
+ * The blocks past the last extent are allocated as one run by a single
+ * balloc call. Return 0 if the run does not fit into the extents.
+ */
+static uint32_t emap(struct inode *ip, uint32_t bn, uint32_t *n) {
+    struct dinode *dp = &ip->disk_inode;
+    struct disk *disk = ip->disk;
+    struct eleaf leaf;
+    struct extent *ext;
+    uint32_t addr = 0, goal = 0;
+    bool dirty = false;
+
+    eleaf_get(ip, bn, &leaf);
+    ext = leaf.ext;
+    for (int i = leaf.n - 1; i >= 0; i--) {
+        if (bn >= ext[i].lblock) {
+            uint32_t off = bn - ext[i].lblock;
+            if (off < ext[i].len) {
+                if (*n > ext[i].len - off) {
+                    *n = ext[i].len - off;
+                }
+                addr = ext[i].pblock + off;
+            } else {
+                // Only the blocks after the end of the file are missing.
+                ASSERT(i == (int) leaf.n - 1);
+                goal = ext[i].pblock + off;
+            }
+            break;
+        }
+    }
+
+    if (addr == 0) {
+        if (dp->type == INODE_FILE) {
+            addr = balloc_data_run(disk, goal, n);
+        } else {
+            addr = balloc_run(disk, goal, n);
+        }
+        if (!emap_append(ip, &leaf, bn, addr, *n)) {
+            for (uint32_t i = 0; i < *n; i++) {
+                bfree(disk, addr + i);
+            }
+            addr = 0;
+        } else {
+            dirty = true;
+        }
+    }
+
+    eleaf_put(ip, &leaf, dirty);
+    return addr;
+}
+
+/**
+ * Return the disk block of the block @bn of @ip, allocating it if needed.
+ * *@n is the number of blocks wanted from @bn on, and is set to the number
+ * of them that follow the block on the disk, always 1 for the indirect
+ * format. Return 0 if there is no room for the block in the inode.
+ */
+static uint32_t bmap_run(struct inode *ip, uint32_t bn, uint32_t *n) {
+    if (ip->disk_inode.flags & INODE_FLAGS_EXTENTS) {
+        return emap(ip, bn, n);
+    }
+    *n = 1;
+    return bmap(ip, bn);
+}
+
 struct inode *inode_alloc(struct disk *disk, enum inode_type typ) {
-    struct superblock *sb;
     struct buf *buf;
     struct dinode *dip;
     uint32_t inum;
 
-    sb = disk->sb;
-
-    // inum = 1: inum 0 is the NULL inode.
-    for (inum = 1; inum < sb->ninodes; inum++) {
-        buf = buf_read(disk, GET_INODE_BLOCK_NO(inum, *sb));
-        dip = (struct dinode *) buf->data + (inum % INODES_PER_BLOCK);
-        if (dip->type == INODE_NONE) {
-            memset(dip, 0, sizeof(*dip));
-            dip->type = typ;
-            log_write(disk->log, buf);
-            buf_release(buf);
-            return iget(disk, inum);
-        }
-        buf_release(buf);
+    // The inode bitmap marks inum 0(the NULL inode) allocated.
+    inum = ialloc(disk);
+    buf = buf_read(disk, GET_INODE_BLOCK_NO(inum, *disk->sb));
+    dip = (struct dinode *) buf->data + (inum % INODES_PER_BLOCK);
+    ASSERT(dip->type == INODE_NONE);
+    memset(dip, 0, sizeof(*dip));
+    dip->type = typ;
+    if ((disk->sb->flags & SB_FLAGS_EXTENTS) && typ != INODE_DEVICE) {
+        dip->flags = INODE_FLAGS_EXTENTS;
     }
-
-    PANIC("inode_alloc: no inodes.");
-    return NULL;
+    log_write(disk->log, buf);
+    buf_release(buf);
+    return iget(disk, inum);
 }
 
 void inode_update(struct inode *ip) {
@@ -202,27 +683,120 @@ void inode_unlock(struct inode *ip) {
     sem_signal(&ip->sem);
 }
 
+/**
+ * Drop a reference of @ip.
+ */
+static void inode_release(struct inode *ip) {
+    bool int_save;
+    spinlock_acquire(&icache.lock, &int_save);
+    if (--ip->ref == 0) {
+        // A freed inode is recycled first, a valid one is kept as long as
+        // possible.
+        if (ip->valid) {
+            list_push(&icache.lru, &ip->lru);
+        } else {
+            list_offer(&icache.lru, &ip->lru);
+        }
+    }
+    spinlock_release(&icache.lock, &int_save);
+}
+
 void inode_put(struct inode *ip) {
     bool int_save;
+    bool orphan = false;
+
     ASSERT(ip->ref >= 1);
     sem_wait(&ip->sem);
     if (ip->valid && ip->disk_inode.nlink == 0) {
+        // The last reference goes to the orphans.
         spinlock_acquire(&icache.lock, &int_save);
         if (ip->ref == 1) {
-            itruncate(ip);
-            ip->disk_inode.type = INODE_NONE;
-            inode_update(ip);
-            ip->valid = false;
+            list_push(&icache.orphans, &ip->lru);
+            orphan = true;
         }
         spinlock_release(&icache.lock, &int_save);
     }
     sem_signal(&ip->sem);
 
+    if (!orphan) {
+        inode_release(ip);
+    }
+}
+
+void inode_reclaim() {
+    struct inode *ip;
+    bool int_save;
+
     spinlock_acquire(&icache.lock, &int_save);
-    ip->ref--;
+    if (icache.reclaiming) {
+        // The orphans added meanwhile are freed by the same loop.
+        spinlock_release(&icache.lock, &int_save);
+        return;
+    }
+    icache.reclaiming = true;
+    while (!list_empty(&icache.orphans)) {
+        ip = NODE_AS(struct inode, LIST_FIRST(&icache.orphans), lru);
+        list_unlinked(&ip->lru);
+        spinlock_release(&icache.lock, &int_save);
+
+        struct log *log = ip->disk->log;
+        log_begin_op(log, LOG_BUDGET_MAX);
+        sem_wait(&ip->sem);
+        spinlock_acquire(&icache.lock, &int_save);
+        // Another reference taken meanwhile puts it again.
+        bool last = ip->ref == 1;
+        spinlock_release(&icache.lock, &int_save);
+        if (last) {
+            itruncate(ip);
+            ip->disk_inode.type = INODE_NONE;
+            inode_update(ip);
+            ifree(ip->disk, ip->inum);
+            ip->valid = false;
+        }
+        sem_signal(&ip->sem);
+        log_end_op(log);
+        inode_release(ip);
+
+        spinlock_acquire(&icache.lock, &int_save);
+    }
+    icache.reclaiming = false;
     spinlock_release(&icache.lock, &int_save);
 }
 
+void inode_reclaim_orphans(struct disk *disk) {
+    struct superblock *sb = disk->sb;
+    uint32_t inums[INODES_PER_BLOCK];
+    uint32_t norphans = 0;
+
+    for (uint32_t bn = 0; bn < ROUND_UP(sb->ninodes, INODES_PER_BLOCK); bn++) {
+        uint32_t n = 0;
+        struct buf *buf = buf_read(disk, sb->inode_start + bn);
+        struct dinode *dinodes = (struct dinode *) buf->data;
+        for (uint32_t i = 0; i < INODES_PER_BLOCK; i++) {
+            uint32_t inum = bn * INODES_PER_BLOCK + i;
+            if (inum != 0 && inum < sb->ninodes && dinodes[i].type != INODE_NONE &&
+                dinodes[i].nlink == 0) {
+                inums[n++] = inum;
+            }
+        }
+        buf_release(buf);
+
+        // The last reference of an unlinked inode makes it an orphan.
+        for (uint32_t i = 0; i < n; i++) {
+            struct inode *ip = iget(disk, inums[i]);
+            inode_lock(ip);
+            inode_unlock(ip);
+            inode_put(ip);
+        }
+        norphans += n;
+    }
+
+    inode_reclaim();
+    if (norphans > 0) {
+        printk("    %s: %d unlinked inodes freed\n", disk->name, norphans);
+    }
+}
+
 void inode_unlockput(struct inode *ip) {
     inode_unlock(ip);
     inode_put(ip);
@@ -252,9 +826,13 @@ int inode_read(struct inode *ip, void *dst, uint32_t offset, uint32_t n) {
         n = dp->size - offset;
     }
 
-    for (uint32_t total = 0; total < n; total += m, offset += m, dst += m) {
-        uint32_t bn = offset / BLOCK_SIZE;
-        uint32_t db_addr = bmap(ip, bn);
+    // The blocks of a run are mapped by one lookup.
+    uint32_t db_addr = 0, run = 0;
+    for (uint32_t total = 0; total < n; total += m, offset += m, dst += m, db_addr++, run--) {
+        if (run == 0) {
+            run = ROUND_UP(offset + n - total, BLOCK_SIZE) - offset / BLOCK_SIZE;
+            db_addr = bmap_run(ip, offset / BLOCK_SIZE, &run);
+        }
         buf = buf_read(ip->disk, db_addr);
 
         m = BLOCK_SIZE - offset % BLOCK_SIZE;
@@ -268,10 +846,39 @@ int inode_read(struct inode *ip, void *dst, uint32_t offset, uint32_t n) {
     return n;
 }
 
+void inode_readahead(struct inode *ip, uint32_t bn, uint32_t nblocks) {
+    struct dinode *dp = &ip->disk_inode;
+    uint32_t end;
+
+    if (dp->type == INODE_DEVICE) {
+        return;
+    }
+
+    end = ROUND_UP(dp->size, BLOCK_SIZE);
+    if (end > MAX_DATA_BLOCKS) {
+        end = MAX_DATA_BLOCKS;
+    }
+    if (bn >= end) {
+        return;
+    }
+    if (end - bn > nblocks) {
+        end = bn + nblocks;
+    }
+    while (bn < end) {
+        uint32_t run = end - bn;
+        uint32_t addr = bmap_run(ip, bn, &run);
+        for (uint32_t i = 0; i < run; i++) {
+            buf_readahead(ip->disk, addr + i);
+        }
+        bn += run;
+    }
+}
+
 int inode_write(struct inode *ip, void *src, uint32_t offset, uint32_t n) {
     struct buf *buf;
     struct dinode *dp;
     uint32_t m;
+    bool full = false;
 
     dp = &ip->disk_inode;
 
@@ -289,13 +896,20 @@ int inode_write(struct inode *ip, void *src, uint32_t offset, uint32_t n) {
         return -1;
     }
 
-    if (offset + n > MAX_DATA_BLOCKS * BLOCK_SIZE) {
+    // In blocks, MAX_DATA_BLOCKS * BLOCK_SIZE overflows with large blocks.
+    if (ROUND_UP(offset + n, BLOCK_SIZE) > MAX_DATA_BLOCKS) {
         return -1;
     }
 
-    for (uint32_t total = 0; total < n; total += m, offset += m, src += m) {
-        uint32_t bn = offset / BLOCK_SIZE;
-        uint32_t db_addr = bmap(ip, bn);
+    uint32_t db_addr = 0, run = 0, total;
+    for (total = 0; total < n; total += m, offset += m, src += m, db_addr++, run--) {
+        if (run == 0) {
+            run = ROUND_UP(offset + n - total, BLOCK_SIZE) - offset / BLOCK_SIZE;
+            if ((db_addr = bmap_run(ip, offset / BLOCK_SIZE, &run)) == 0) {
+                full = true;
+                break;
+            }
+        }
         buf = buf_read(ip->disk, db_addr);
 
         m = BLOCK_SIZE - offset % BLOCK_SIZE;
@@ -304,16 +918,25 @@ int inode_write(struct inode *ip, void *src, uint32_t offset, uint32_t n) {
         }
         memcpy(buf->data + (offset % BLOCK_SIZE), src, m);
 
-        log_write(ip->disk->log, buf);
+        if (dp->type == INODE_FILE) {
+            log_write_data(ip->disk->log, buf);
+        } else {
+            log_write(ip->disk->log, buf);
+        }
         buf_release(buf);
     }
 
-    if (n > 0 && offset > dp->size) {
+    if (total > 0 && offset > dp->size) {
         dp->size = offset;
         inode_update(ip);
     }
 
-    return n;
+    // The extents have no room for the rest of the data, return the bytes
+    // written before.
+    if (full && total == 0) {
+        return -1;
+    }
+    return total;
 }
 
 #ifdef __cplusplus
@@ -1,6 +1,10 @@
+#include "fs/inodes.h"
 #include "fs/log.h"
 #include "fs/superblock.h"
 #include "kernel/buf.h"
+#include "kernel/memory.h"
+#include "kernel/task.h"
+#include "kernel/timer.h"
 
 #include "stdbool.h"
 #include "string.h"
@@ -12,158 +16,564 @@ extern "C" {
 #endif /* __cplusplus */
 
 /**
- * Copy committed blocks from log to their home location.
+ * Wait for the writes queued on @bufs and release the buffers.
+ *
+ * A transaction that cannot be made durable stops the kernel, since the
+ * file system has gone on as if it was committed.
  */
-static void install_trans(struct log *log) {
-    for (int i = 0; i < log->lh.n; i++) {
-        struct buf *logb = buf_read(log->disk, log->log_start + i + 1);
-        struct buf *datab = buf_read(log->disk, log->lh.blocks[i]);
-        memcpy(datab->data, logb->data, BLOCK_SIZE);
-        buf_write(datab);
-        buf_release(logb);
-        buf_release(datab);
+static void wait_writes(struct buf **bufs, int n) {
+    for (int i = 0; i < n; i++) {
+        if (buf_wait(bufs[i]) < 0) {
+            PANIC("log: cannot write block %d", bufs[i]->block_no);
+        }
+        buf_release(bufs[i]);
+    }
+}
+
+/**
+ * Return the block number of the area offset @pos.
+ */
+static inline uint32_t area_block(struct log *log, uint32_t pos) {
+    return log->log_start + 1 + pos % log->size;
+}
+
+static inline void replay_map_set(struct log *log, uint32_t block_no) {
+    uint32_t bit = block_no % LOG_REPLAY_BITS;
+    log->replay_map[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline bool replay_map_test(struct log *log, uint32_t block_no) {
+    uint32_t bit = block_no % LOG_REPLAY_BITS;
+    return (log->replay_map[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+/**
+ * Write the in-memory tail to the log super block.
+ */
+static void write_super(struct log *log) {
+    struct buf *buf = buf_read(log->disk, log->log_start);
+    struct log_super *super = (struct log_super *) buf->data;
+
+    super->magic = LOG_MAGIC;
+    super->tail = log->tail;
+    super->seq = log->tail_seq;
+
+    if (buf_write(buf) < 0) {
+        PANIC("log: cannot write the log super block");
     }
+    buf_release(buf);
 }
 
 /**
- * Copy modified blocks from cache to log.
+ * Copy the closed transaction into buffers of the log area from its head:
+ * @bufs[0] is the descriptor and @bufs[1..n] are the blocks. The operations
+ * of the transaction have ended and new ones wait, the pinned buffers are
+ * not changing.
  */
-static void write_log(struct log *log) {
-    for (int i = 0; i < log->lh.n; i++) {
-        struct buf *to = buf_read(log->disk, log->log_start + i + 1);
-        struct buf *from = buf_read(log->disk, log->lh.blocks[i]);
+static void copy_trans(struct log *log, struct buf **bufs) {
+    struct logheader *lh = log->clh;
+    uint32_t pos = log->head;
+
+    struct buf *buf = buf_overwrite(log->disk, area_block(log, pos));
+    struct log_desc *desc = (struct log_desc *) buf->data;
+    memset(desc, 0, BLOCK_SIZE);
+    desc->magic = LOG_DESC_MAGIC;
+    desc->seq = log->seq;
+    desc->n = lh->n;
+    for (int i = 0; i < lh->n; i++) {
+        desc->blocks[i] = lh->blocks[i];
+    }
+    bufs[0] = buf;
+
+    for (int i = 0; i < lh->n; i++) {
+        struct buf *to = buf_overwrite(log->disk, area_block(log, pos + i + 1));
+        struct buf *from = lh->bufs[i];
+        ASSERT(from->block_no == lh->blocks[i] && (from->flags & BUF_FLAGS_DIRTY));
         memcpy(to->data, from->data, BLOCK_SIZE);
-        buf_write(to);
-        buf_release(to);
-        buf_release(from);
+        bufs[i + 1] = to;
     }
 }
 
 /**
- * Write in-memory log head to log->disk.
+ * Write the transaction copied by copy_trans() at the head of the log. The
+ * commit block is written once the descriptor and the data blocks are on
+ * the disk.
  */
-static void write_head(struct log *log) {
-    struct buf *buf = buf_read(log->disk, log->log_start);
-    struct logheader *lh = (struct logheader *) buf->data;
+static void write_trans(struct log *log, struct buf **bufs) {
+    uint32_t pos = log->head;
+    int n = log->clh->n;
 
-    lh->n = log->lh.n;
-    for (int i = 0; i < log->lh.n; i++) {
-        lh->blocks[i] = log->lh.blocks[i];
+    for (int i = 0; i <= n; i++) {
+        buf_write_async(bufs[i], NULL, NULL);
     }
+    wait_writes(bufs, n + 1);
 
-    buf_write(buf);
+    // The real commit.
+    struct buf *buf = buf_overwrite(log->disk, area_block(log, pos + n + 1));
+    struct log_commit *rec = (struct log_commit *) buf->data;
+    memset(rec, 0, BLOCK_SIZE);
+    rec->magic = LOG_COMMIT_MAGIC;
+    rec->seq = log->seq;
+    rec->n = n;
+    if (buf_write(buf) < 0) {
+        PANIC("log: cannot write the commit block");
+    }
     buf_release(buf);
+
+    log->head = (pos + n + 2) % log->size;
+    log->seq++;
 }
 
 /**
- * Read the log header from disk into the in-menory log header.
+ * Replay the transaction at the head of the log if it is valid and move the
+ * head past it(recovery). Return false at the end of the log.
+ *
+ * The home blocks are written back by the buffer cache. They must be on
+ * the disk before the tail is moved, see checkpoint().
  */
-static void read_head(struct log *log) {
-    struct buf *buf = buf_read(log->disk, log->log_start);
-    struct logheader *lh = (struct logheader *) buf->data;
+static bool replay_trans(struct log *log) {
+    struct logheader *lh = log->lh;
+    uint32_t pos = log->head;
+    uint32_t n;
 
-    log->lh.n = lh->n;
-    for (int i = 0; i < log->lh.n; i++) {
-        log->lh.blocks[i] = lh->blocks[i];
+    struct buf *buf = buf_read(log->disk, area_block(log, pos));
+    struct log_desc *desc = (struct log_desc *) buf->data;
+    n = desc->n;
+    bool valid = desc->magic == LOG_DESC_MAGIC && desc->seq == log->seq &&
+                 n <= (uint32_t) log->trans_max && log->used + n + 2 <= log->size;
+    if (valid) {
+        for (uint32_t i = 0; i < n; i++) {
+            lh->blocks[i] = desc->blocks[i];
+        }
+    }
+    buf_release(buf);
+    if (!valid) {
+        return false;
     }
 
+    buf = buf_read(log->disk, area_block(log, pos + n + 1));
+    struct log_commit *rec = (struct log_commit *) buf->data;
+    valid = rec->magic == LOG_COMMIT_MAGIC && rec->seq == log->seq && rec->n == n;
     buf_release(buf);
+    if (!valid) { // Crashed before the commit.
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct buf *logb = buf_read(log->disk, area_block(log, pos + i + 1));
+        struct buf *datab = buf_read(log->disk, lh->blocks[i]);
+        memcpy(datab->data, logb->data, BLOCK_SIZE);
+        buf_release(logb);
+        buf_write_delayed(datab);
+        buf_release(datab);
+    }
+
+    log->head = (pos + n + 2) % log->size;
+    log->used += n + 2;
+    log->seq++;
+    return true;
+}
+
+/**
+ * Empty the transaction @lh.
+ */
+static void trans_reset(struct logheader *lh) {
+    lh->n = 0;
+    lh->ndata = 0;
+    memset(lh->hash, 0xff, sizeof lh->hash);
+}
+
+/**
+ * Return the slot of @block_no in the transaction @lh or -1.
+ */
+static int trans_lookup(struct logheader *lh, uint32_t block_no) {
+    for (int i = lh->hash[block_no % LOG_HASH_SIZE]; i >= 0; i = lh->next[i]) {
+        if (lh->blocks[i] == block_no) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * The blocks of the closed transaction are committed, unpin them and let
+ * the buffer cache write them back. The ones written again by the running
+ * transaction stay pinned.
+ */
+static void release_trans(struct log *log) {
+    bool int_save;
+
+    for (int i = 0; i < log->clh->n; i++) {
+        // Operations modify a block while holding its buffer.
+        struct buf *buf = buf_read(log->disk, log->clh->blocks[i]);
+        spinlock_acquire(&log->lock, &int_save);
+        bool running = trans_lookup(log->lh, buf->block_no) >= 0;
+        spinlock_release(&log->lock, &int_save);
+        if (!running) {
+            buf_write_delayed(buf);
+        }
+        buf_release(buf);
+    }
 }
 
-static void commit(struct log *log) {
-    if (log->lh.n > 0) {
-        write_log(log);
-        write_head(log);
-        install_trans(log);
-        // Clear log head.
-        log->lh.n = 0;
-        write_head(log);
+/**
+ * Make the home blocks of all committed transactions durable and move the
+ * tail to the head.
+ */
+static void checkpoint(struct log *log) {
+    if (bio_sync(log->disk) < 0) {
+        PANIC("log: cannot write the home blocks for a checkpoint");
     }
+    log->tail = log->head;
+    log->tail_seq = log->seq;
+    log->used = 0;
+    memset(log->replay_map, 0, sizeof log->replay_map);
+    write_super(log);
+    log->checkpoints++;
 }
 
+/**
+ * Return true if the log has room for a transaction of @n blocks.
+ */
+static inline bool log_has_room(struct log *log, uint32_t n) {
+    return log->used + n + 2 <= log->size;
+}
+
+/**
+ * Return true if the running transaction has blocks.
+ */
+static inline bool trans_dirty(struct log *log) {
+    return log->lh->n > 0 || log->lh->ndata > 0;
+}
+
+/**
+ * Replay the transactions from the tail in the log super block, then
+ * checkpoint them. A log without the magic number is formatted.
+ */
 static void recover_from_log(struct log *log) {
-    read_head(log);
-    install_trans(log);
-    // Clear log head.
-    log->lh.n = 0;
-    write_head(log);
+    struct buf *buf = buf_read(log->disk, log->log_start);
+    struct log_super *super = (struct log_super *) buf->data;
+
+    if (super->magic == LOG_MAGIC && super->tail < log->size) {
+        log->head = super->tail;
+        log->seq = super->seq;
+    } else {
+        log->head = 0;
+        log->seq = 1;
+    }
+    buf_release(buf);
+
+    log->tail = log->head;
+    log->tail_seq = log->seq;
+    log->used = 0;
+    while (replay_trans(log)) {
+    }
+    trans_reset(log->lh);
+    checkpoint(log);
 }
 
-void log_begin_op(struct log *log) {
+/**
+ * Ask the committer to commit now. Caller must hold log->lock.
+ */
+static inline void request_commit(struct log *log) {
+    log->commit_req = true;
+    if (!list_empty(&log->commit_sem.waiting_tasks)) {
+        sem_signal(&log->commit_sem);
+    }
+}
+
+/**
+ * The committer thread of a log.
+ */
+static void log_committer(void *data) {
+    struct log *log = data;
+    struct buf *bufs[LOG_TRANS_MAX + 1];
+    bool int_save;
+
+    for (;;) {
+        // Wait for a transaction.
+        spinlock_acquire(&log->lock, &int_save);
+        while (!trans_dirty(log) && !log->commit_req) {
+            sem_wait(&log->commit_sem);
+        }
+        spinlock_release(&log->lock, &int_save);
+
+        // Let more operations join the transaction.
+        unsigned long start = get_tick_count();
+        while (!log->commit_req && get_tick_count() - start < LOG_COMMIT_WINDOW) {
+            task_yield();
+        }
+
+        // Stop new operations and wait for the running ones to end.
+        spinlock_acquire(&log->lock, &int_save);
+        log->closing = true;
+        log->commit_req = false;
+        while (log->outstanding > 0) {
+            sem_wait(&log->commit_sem);
+        }
+
+        // Close the running transaction and open a new one.
+        struct logheader *lh = log->clh;
+        log->clh = log->lh;
+        log->lh = lh;
+        trans_reset(log->lh);
+        log->closed++;
+        int n = log->clh->n;
+        if (n > 0) {
+            log->used += n + 2;
+            for (int i = 0; i < n; i++) {
+                replay_map_set(log, log->clh->blocks[i]);
+            }
+        }
+        // The checkpoint needs the home blocks of all transactions, new
+        // operations wait until it is done.
+        bool ckpt =
+            log->used >= log->size / LOG_CHECKPOINT_RATIO || !log_has_room(log, log->trans_max);
+        spinlock_release(&log->lock, &int_save);
+
+        if (n > 0) {
+            copy_trans(log, bufs);
+        }
+        if (!ckpt) {
+            spinlock_acquire(&log->lock, &int_save);
+            log->closing = false;
+            if (!list_empty(&log->wait_sem.waiting_tasks)) {
+                sem_signalall(&log->wait_sem);
+            }
+            spinlock_release(&log->lock, &int_save);
+        }
+
+        // Ordered data goes first, the committed metadata may point to it.
+        if (bio_write_blocks(log->disk, log->clh->data, log->clh->ndata) < 0) {
+            PANIC("log: cannot write the ordered data");
+        }
+        if (n > 0) {
+            write_trans(log, bufs);
+            release_trans(log);
+        }
+        if (ckpt) {
+            checkpoint(log);
+        }
+
+        spinlock_acquire(&log->lock, &int_save);
+        log->closing = false;
+        log->commits++;
+        if (!list_empty(&log->wait_sem.waiting_tasks)) {
+            sem_signalall(&log->wait_sem);
+        }
+        if (!list_empty(&log->sync_sem.waiting_tasks)) {
+            sem_signalall(&log->sync_sem);
+        }
+        spinlock_release(&log->lock, &int_save);
+    }
+}
+
+void log_begin_op(struct log *log, int nblocks) {
+    ASSERT(nblocks >= 0);
+    if (nblocks > log->trans_max) {
+        nblocks = log->trans_max;
+    }
+
     bool int_save;
     spinlock_acquire(&log->lock, &int_save);
     while (1) {
-        if (log->committing) {
+        int need = log->lh->n + log->reserved + nblocks;
+        // An operation writes fewer data blocks than its budget, so the
+        // ordered data of the running operations fit in the transaction.
+        int need_data = log->lh->ndata + log->reserved + nblocks;
+        if (log->closing) {
             sem_wait(&log->wait_sem);
-        } else if (log->lh.n + (log->outstanding + 1) * MAX_OPEN_BLOCKS > LOG_SIZE) {
+        } else if (need > log->trans_max || !log_has_room(log, need) ||
+                   (log->ordered && need_data > LOG_DATA_MAX)) {
+            // The transaction or the log is full, commit(and checkpoint)
+            // without waiting for the window.
+            request_commit(log);
             sem_wait(&log->wait_sem);
         } else {
             log->outstanding++;
+            log->reserved += nblocks;
+            if (log->closed != log->commits) {
+                log->overlaps++;
+            }
             break;
         }
     }
+    get_current_task()->log_budget = nblocks;
     spinlock_release(&log->lock, &int_save);
 }
 
 void log_end_op(struct log *log) {
     bool int_save;
-    bool do_commit = false;
-    ASSERT(!log->committing);
+
+    struct task_struct *task = get_current_task();
 
     spinlock_acquire(&log->lock, &int_save);
+    // Give the unused blocks back.
+    log->reserved -= task->log_budget;
+    task->log_budget = 0;
     log->outstanding--;
     if (log->outstanding == 0) { // All operations end.
-        do_commit = true;
-        log->committing = true;
-    } else if (!list_empty(&log->wait_sem.waiting_tasks)) {
-        sem_signal(&log->wait_sem);
+        // Wake up the committer, which waits for a transaction or for the
+        // operations to end.
+        if (!list_empty(&log->commit_sem.waiting_tasks)) {
+            sem_signal(&log->commit_sem);
+        }
+    }
+    if (!list_empty(&log->wait_sem.waiting_tasks)) {
+        sem_signalall(&log->wait_sem);
     }
     spinlock_release(&log->lock, &int_save);
 
-    if (do_commit) {
-        commit(log);
-        spinlock_acquire(&log->lock, &int_save);
-        log->committing = false;
-        sem_signal(&log->wait_sem);
-        spinlock_release(&log->lock, &int_save);
+    inode_reclaim();
+}
+
+void log_force(struct log *log) {
+    bool int_save;
+
+    spinlock_acquire(&log->lock, &int_save);
+    // The operations ended so far are in the running transaction, which is
+    // closed next, or in the one being committed.
+    uint32_t target = log->commits;
+    if (trans_dirty(log)) {
+        target = log->closed + 1;
+        request_commit(log);
+    } else if (log->closed != log->commits) {
+        target = log->closed;
     }
+    while ((int32_t)(log->commits - target) < 0) {
+        sem_wait(&log->sync_sem);
+    }
+    spinlock_release(&log->lock, &int_save);
 }
 
 void log_write(struct log *log, struct buf *buf) {
 
     ASSERT(log->disk == buf->disk);
-    ASSERT(log->lh.n < LOG_SIZE);
     ASSERT(log->outstanding >= 1);
 
     bool int_save;
     spinlock_acquire(&log->lock, &int_save);
-    int i;
-    for (i = 0; i < log->lh.n; i++) {
-        if (log->lh.blocks[i] == buf->block_no) {
-            break;
+    // Absorb repeated writes within the running transaction.
+    int i = trans_lookup(log->lh, buf->block_no);
+    if (i < 0) {
+        // A new block of the transaction, charge it to the operation.
+        struct task_struct *task = get_current_task();
+        if (task->log_budget > 0) {
+            task->log_budget--;
+            log->reserved--;
+        } else if (log->lh->n + log->reserved < log->trans_max) {
+            log->overruns++;
+        } else {
+            PANIC("log_write: the operation is over its budget.");
         }
+
+        struct logheader *lh = log->lh;
+        i = lh->n++;
+        lh->blocks[i] = buf->block_no;
+        lh->bufs[i] = buf;
+        uint32_t h = buf->block_no % LOG_HASH_SIZE;
+        lh->next[i] = lh->hash[h];
+        lh->hash[h] = i;
     }
-    log->lh.blocks[i] = buf->block_no;
-    if (i == log->lh.n) {
-        log->lh.n++;
-    }
+    ASSERT(log->lh->bufs[i] == buf);
     buf->flags |= BUF_FLAGS_DIRTY;
     spinlock_release(&log->lock, &int_save);
 }
 
-void log_init(struct log *log, struct disk *disk, int log_start) {
+void log_write_data(struct log *log, struct buf *buf) {
+    if (!log->ordered) {
+        log_write(log, buf);
+        return;
+    }
+
+    ASSERT(log->disk == buf->disk);
+    ASSERT(log->outstanding >= 1);
+
+    bool int_save;
+    bool logged = false;
+    bool full = false;
+    spinlock_acquire(&log->lock, &int_save);
+    struct logheader *lh = log->lh;
+    if (trans_lookup(lh, buf->block_no) >= 0 || replay_map_test(log, buf->block_no)) {
+        logged = true;
+    } else if (lh->ndata == 0 || lh->data[lh->ndata - 1] != buf->block_no) {
+        if (lh->ndata < LOG_DATA_MAX) {
+            lh->data[lh->ndata++] = buf->block_no;
+        } else {
+            full = true;
+        }
+    }
+    spinlock_release(&log->lock, &int_save);
+
+    if (logged) {
+        log_write(log, buf);
+    } else if (full) {
+        // Only an operation over its budget gets here.
+        if (buf_write(buf) < 0) {
+            PANIC("log: cannot write the ordered data");
+        }
+    } else {
+        buf_write_delayed(buf);
+    }
+}
+
+bool log_block_reusable(struct log *log, uint32_t block_no) {
+    return !log->ordered || !replay_map_test(log, block_no);
+}
+
+void log_block_freed(struct log *log, uint32_t block_no) {
+    bool int_save;
+    spinlock_acquire(&log->lock, &int_save);
+    replay_map_set(log, block_no);
+    spinlock_release(&log->lock, &int_save);
+}
+
+int log_budget_left(struct log *log) {
+    ASSERT(log->outstanding >= 1);
+    return get_current_task()->log_budget;
+}
+
+void log_open(struct log *log, struct disk *disk, int log_start, int nlog) {
     spinlock_init(&log->lock);
     sem_init(&log->wait_sem, 0, "log");
+    sem_init(&log->commit_sem, 0, "log_commit");
+    sem_init(&log->sync_sem, 0, "log_sync");
 
     log->disk = disk;
     log->log_start = log_start;
     log->outstanding = 0;
-    log->committing = false;
-    log->lh.n = 0;
+    log->closing = false;
+    log->commit_req = false;
+    log->closed = 0;
+    log->commits = 0;
+    log->checkpoints = 0;
+    log->reserved = 0;
+    log->overruns = 0;
+    log->overlaps = 0;
+    log->ordered = (disk->sb->flags & SB_FLAGS_ORDERED) != 0;
+    memset(log->replay_map, 0, sizeof log->replay_map);
+    log->lh = kalloc(sizeof(struct logheader));
+    log->clh = kalloc(sizeof(struct logheader));
+    ASSERT(log->lh != NULL && log->clh != NULL);
+    trans_reset(log->lh);
+    trans_reset(log->clh);
+
+    // The log super block and the circular area.
+    log->size = nlog - 1;
+    log->trans_max = log->size - 2;
+    if (log->trans_max > (int) LOG_TRANS_MAX) {
+        log->trans_max = LOG_TRANS_MAX;
+    }
+    ASSERT(nlog > 3 && log->trans_max >= MAX_OPEN_BLOCKS);
 
     recover_from_log(log);
 }
 
+void log_init(struct log *log, struct disk *disk, int log_start, int nlog) {
+    log_open(log, disk, log_start, nlog);
+    kthread_start(log_committer, log, 10, "log_%s", disk->name);
+}
+
 #ifdef __cplusplus
 #if __cplusplus
 }
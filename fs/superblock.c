@@ -65,10 +65,14 @@ static void print_data_bitmap(struct disk *disk, struct superblock *sb) {
 void print_superblock(struct disk *disk, struct superblock *sb, bool details) {
     printk("Superblock in the disk %s:\n", disk->name);
 
+    printk("    Block Size:            %d\n", sb->block_size);
     printk("    Inodes:                %d\n", sb->ninodes);
     printk("    Inode Block Range:     [%d, %d]\n", sb->inode_start,
            sb->inode_start + ROUND_UP(sb->ninodes, INODES_PER_BLOCK));
 
+    printk("    Inode BMap Range:      [%d, %d]\n", sb->imap_start,
+           sb->imap_start + ROUND_UP(sb->ninodes, BITS_PER_BLOCK));
+
     printk("    Log Blocks:            %d\n", sb->nlog);
     printk("    Log Block Range:       [%d, %d]\n", sb->log_start, sb->log_start + sb->nlog);
 
@@ -78,6 +82,9 @@ void print_superblock(struct disk *disk, struct superblock *sb, bool details) {
 
     printk("    Data Blocks:           %d\n", sb->nblocks);
     printk("    Data Block Start:      %d (Block Number)\n", sb->bdata_start);
+    printk("    Journaling:            %s\n", (sb->flags & SB_FLAGS_ORDERED) ? "ordered" : "data");
+    printk("    Block Mapping:         %s\n",
+           (sb->flags & SB_FLAGS_EXTENTS) ? "extents" : "indirect");
 
     if (details) {
         print_inode_usage(disk, sb);
@@ -28,6 +28,11 @@ struct file {
     struct inode *inode;
     struct pipe *pipe;
     uint32_t offset;
+
+    // Sequential read-ahead state (FD_INODE only).
+    uint32_t ra_next;   // Offset where a sequential read would continue.
+    uint32_t ra_window; // Number of blocks to keep in flight, 0 if random.
+    uint32_t ra_end;    // First block that has not been read ahead yet.
 };
 
 struct devio {
@@ -55,6 +60,15 @@ void file_close(struct file *f);
 
 struct file *file_dup(struct file *f);
 
+/**
+ * Reset the read-ahead state of @f, which is going to be read from @f->offset.
+ */
+static inline void file_ra_init(struct file *f) {
+    f->ra_next = f->offset;
+    f->ra_window = 0;
+    f->ra_end = 0;
+}
+
 int file_read(struct file *f, void *dst, uint32_t n);
 int file_write(struct file *f, void *src, uint32_t n);
 
@@ -1,6 +1,7 @@
 #ifndef _FS_INODES_H
 #define _FS_INODES_H
 
+#include "kernel/list.h"
 #include "kernel/semaphore.h"
 #include "stdint.h"
 #include "sys/stat.h"
@@ -12,6 +13,7 @@ extern "C" {
 #endif /* __cplusplus */
 
 #define NDIRECT_DATA_BLOCKS 11
+#define NINDIRECT_LEVELS    3 // Single, double and triple indirect blocks.
 
 enum inode_type {
     INODE_NONE = 0,
@@ -20,6 +22,26 @@ enum inode_type {
     INODE_DEVICE = T_DEVICE,
 };
 
+// Inode flags.
+#define INODE_FLAGS_EXTENTS 0x1 // The blocks are mapped by extents.
+#define INODE_FLAGS_EINDEX  0x2 // The extent block is an index of extent blocks.
+
+/**
+ * A run of blocks of an extent-mapped inode, contiguous in the file and
+ * on the disk.
+ */
+struct extent {
+    uint32_t lblock; // First block in the file.
+    uint32_t pblock; // First block on the disk.
+    uint32_t len;    // Number of blocks.
+} __attribute__((packed));
+
+// Number of extents in the inode.
+#define NINODE_EXTENTS 4
+
+// Number of extents in an extent block.
+#define NBLOCK_EXTENTS (BLOCK_SIZE / sizeof(struct extent))
+
 // On-disk inode structure.
 struct dinode {
     enum inode_type type; // File type.
@@ -27,9 +49,24 @@ struct dinode {
     uint32_t size;        // Size of file (bytes)
     int32_t major;        // Major number of device(INODE_DEVICE only)
     int32_t minor;        // Minor number of device(INODE_DEVICE only)
-
-    // describe data block address.
-    uint32_t addrs[NDIRECT_DATA_BLOCKS + 1];
+    uint32_t flags;       // INODE_FLAGS_*.
+
+    union {
+        // describe data block address: the direct blocks, then the roots of
+        // the single, double and triple indirect trees.
+        uint32_t addrs[NDIRECT_DATA_BLOCKS + NINDIRECT_LEVELS];
+
+        // INODE_FLAGS_EXTENTS: the extents sorted by lblock, in the inode,
+        // or in the extent block @eblock once there are more than
+        // NINODE_EXTENTS of them. With INODE_FLAGS_EINDEX @eblock is an
+        // index of @nextents extent blocks, whose entries are struct extent
+        // too: the first lblock, the extent block and its number of extents.
+        struct {
+            uint32_t nextents;
+            uint32_t eblock;
+            struct extent extents[NINODE_EXTENTS];
+        };
+    };
 } __attribute__((packed));
 
 
@@ -38,6 +75,8 @@ struct inode {
     struct disk *disk;    // Disk containing disk_inode.
     uint32_t inum;        // Inode number.
     int ref;              // Reference count.
+    struct inode *hnext;  // Next inode in the hash chain of the inode cache.
+    struct list_node lru; // Node in the LRU list while ref is 0.
     struct semaphore sem; // Protects everthing below here.
     bool valid;           // Inode has been read from disk?
 
@@ -50,7 +89,9 @@ struct inode {
 #define NINDIRECT_DATA_BLOCKS (BLOCK_SIZE / sizeof(uint32_t))
 
 // Maximum number of data blocks of a inode.
-#define MAX_DATA_BLOCKS (NDIRECT_DATA_BLOCKS + NINDIRECT_DATA_BLOCKS)
+#define MAX_DATA_BLOCKS                                                                            \
+    (NDIRECT_DATA_BLOCKS + NINDIRECT_DATA_BLOCKS + NINDIRECT_DATA_BLOCKS * NINDIRECT_DATA_BLOCKS + \
+     NINDIRECT_DATA_BLOCKS * NINDIRECT_DATA_BLOCKS * NINDIRECT_DATA_BLOCKS)
 
 // Number of inodes per block
 #define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(struct dinode))
@@ -58,7 +99,18 @@ struct inode {
 // Gets the block number containing inode i.
 #define GET_INODE_BLOCK_NO(i, sb) ((sb).inode_start + ((i) / INODES_PER_BLOCK))
 
+/**
+ * Counters of the inode cache.
+ */
+struct icache_stats {
+    uint32_t lookups; // Number of iget() calls.
+    uint32_t hits;    // Lookups that found the inode in the cache.
+    uint32_t reuses;  // Hits on an unreferenced inode kept by the LRU.
+    uint32_t ninodes; // Number of inodes in the cache.
+};
+
 void inodes_init();
+void icache_get_stats(struct icache_stats *stats);
 
 /**
  * Allocate a new inode in the given disk and return it or NULL
@@ -81,9 +133,42 @@ static inline bool inode_holding(struct inode *ip) {
 void inode_update(struct inode *ip);
 
 struct inode *inode_dup(struct inode *ip);
+
+/**
+ * Drop a reference of @ip. The last reference of an unlinked inode is
+ * kept until inode_reclaim() frees the inode.
+ */
 void inode_put(struct inode *ip);
 
+/**
+ * Truncate and free the unlinked inodes whose last reference is dropped.
+ * Called by log_end_op(), when the caller of the operation holds no inode
+ * lock, since freeing a large file restarts the operation.
+ */
+void inode_reclaim();
+
+/**
+ * Free the unlinked inodes of @disk, which a crash left on the disk before
+ * inode_reclaim() could free them or while it was truncating them. Called
+ * at mount after the recovery of the log.
+ */
+void inode_reclaim_orphans(struct disk *disk);
+
 int inode_read(struct inode *ip, void *dst, uint32_t offset, uint32_t n);
+
+/**
+ * Start reading up to @nblocks data blocks of @ip from the block @bn into
+ * the buffer cache without waiting for them. Blocks past the end of the
+ * file are ignored.
+ *
+ * Caller must hold @ip->lock.
+ */
+void inode_readahead(struct inode *ip, uint32_t bn, uint32_t nblocks);
+/**
+ * Write @n bytes at @offset, which is not past the end of the file. Return
+ * the number of bytes written, less than @n if the extents of an
+ * extent-mapped inode are full, or -1 if none is written.
+ */
 int inode_write(struct inode *ip, void *src, uint32_t offset, uint32_t n);
 
 static inline void inode_stat(struct inode *restrict i, struct stat *restrict s) {
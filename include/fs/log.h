@@ -1,6 +1,7 @@
 #ifndef _FS_LOG_H
 #define _FS_LOG_H
 
+#include "kernel/buf.h"
 #include "kernel/defs.h"
 #include "kernel/ide.h"
 #include "kernel/semaphore.h"
@@ -13,11 +14,42 @@
  *     https://github.com/mit-pdos/xv6-public/blob/master/log.c
  *
  * Usage:
- *     log_begin_op(log);
+ *     log_begin_op(log, nblocks);
  *     buf = buf_read(...)
  *     modify buf->data.
  *     Replace buf_write(buf) with log_write(buf)
  *     log_end_op(log);
+ *
+ * Budgets: an operation declares how many blocks it writes at most, and
+ * log_begin_op() waits until the transaction and the log have room for
+ * them. The new blocks of the transaction written by log_write() are
+ * charged to the operation, and log_end_op() gives the unused ones back.
+ * An operation over its budget takes the blocks nobody reserved, which
+ * is counted in log->overruns, and panics if there are none.
+ *
+ * Group commit: log_end_op() does not commit. A committer thread per log
+ * waits LOG_COMMIT_WINDOW ticks after an operation has ended so that the
+ * following operations join the same transaction, then commits them all.
+ * It commits at once when the transaction is full or log_force() is called.
+ *
+ * Pipelined commit: the committer waits for the operations of the running
+ * transaction to end, copies its blocks into log buffers and opens a new
+ * running transaction. New operations proceed while the closed one is
+ * written. Only a commit followed by a checkpoint keeps them waiting until
+ * the end.
+ *
+ * Ordered data(SB_FLAGS_ORDERED): file data blocks written with
+ * log_write_data() do not go through the log. They are written back by the
+ * buffer cache, and the commit writes the ones of the transaction to their
+ * home location before its commit block. A data block that recovery may
+ * overwrite, because it has a copy in the log or was freed since the last
+ * checkpoint, is still logged; balloc_data() avoids such blocks.
+ *
+ * Circular log: each commit appends a transaction to the log area and the
+ * committed transactions stay there, while the buffer cache writes their
+ * home blocks back. When the log is LOG_CHECKPOINT_RATIO full, or too full
+ * for the next transaction, the committer makes the home blocks durable and
+ * moves the tail of the log to its head(checkpoint).
  */
 
 #ifdef __cplusplus
@@ -27,22 +59,92 @@ extern "C" {
 #endif /* __cplusplus */
 
 #define MAX_OPEN_BLOCKS 10
-#define LOG_SIZE        (MAX_OPEN_BLOCKS * 3)
+
+// Budgets of the operations.
+#define LOG_BUDGET_MAX   MAX_OPEN_BLOCKS // Create or unlink a file.
+#define LOG_BUDGET_PUT   4  // Drop an inode(an unlinked one is freed by inode_reclaim() in
+                            // operations of LOG_BUDGET_MAX blocks).
+#define LOG_BUDGET_WRITE 32 // file_write() chunks, see log_budget_left().
+
+// Maximum number of blocks of a transaction, bounded by its descriptor and
+// by the size of struct logheader, which is allocated by kalloc().
+#define LOG_DESC_MAX  ((BLOCK_SIZE - 3 * sizeof(uint32_t)) / sizeof(uint32_t))
+#define LOG_TRANS_MAX (LOG_DESC_MAX < 240 ? LOG_DESC_MAX : 240)
+
+// Buckets of the block index of a transaction.
+#define LOG_HASH_SIZE 128
+
+// Ordered data blocks of a transaction, more are written synchronously.
+#define LOG_DATA_MAX 128
+
+// Bits of the map of blocks the recovery may overwrite.
+#define LOG_REPLAY_BITS 4096
+
+// Used blocks of the log, 1 / LOG_CHECKPOINT_RATIO, that trigger a checkpoint.
+#define LOG_CHECKPOINT_RATIO 2
+
+// Ticks a transaction stays open for more operations.
+#ifndef LOG_COMMIT_WINDOW
+#define LOG_COMMIT_WINDOW 30
+#endif
+
+#define LOG_MAGIC        0x4C4F4753 // "LOGS"
+#define LOG_DESC_MAGIC   0x4C444553 // "LDES"
+#define LOG_COMMIT_MAGIC 0x4C434D54 // "LCMT"
 
 /**
- * The on-disk log layout:
+ * The on-disk log layout(sb->nlog blocks):
  *
- * log->log_start -> block 1: Header block (struct logheader)
- *                   block 2: Committed data block 1
- *                   block 3: Committed data block 2
- *                   ...
- *                   block N: Committed data block N - 1
- *                   N is LOG_SIZE + 1.
+ * log->log_start -> block 0: Log super block (struct log_super)
+ *                   block 1 .. nlog - 1: The circular area.
+ *
+ * A transaction takes n + 2 contiguous blocks of the area(modulo its size):
+ *
+ *     struct log_desc | data block 1 | ... | data block n | struct log_commit
+ *
+ * The commit block is written after the descriptor and the data blocks are
+ * on the disk, so a transaction is valid if both its descriptor and its
+ * commit block carry its sequence number. The recovery replays the valid
+ * transactions from the tail in sequence order and stops at the first
+ * invalid one. Blocks left from older laps have smaller sequence numbers.
  */
 
+struct log_super {
+    uint32_t magic;
+    uint32_t tail; // Area offset of the oldest transaction not checkpointed.
+    uint32_t seq;  // Sequence number of the transaction at the tail.
+};
+
+struct log_desc {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t n;
+    uint32_t blocks[LOG_TRANS_MAX]; // Home block numbers of the data blocks.
+};
+
+struct log_commit {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t n;
+};
+
+/**
+ * An in-memory transaction.
+ */
 struct logheader {
     int n;
-    uint blocks[LOG_SIZE];
+    uint blocks[LOG_TRANS_MAX];
+    struct buf *bufs[LOG_TRANS_MAX]; // Cache buffers of the blocks, pinned by BUF_FLAGS_DIRTY.
+
+    /**
+     * Index of the blocks: hash[block_no % LOG_HASH_SIZE] is the first slot
+     * of a bucket and next[slot] the following one, -1 ends a bucket.
+     */
+    int16_t hash[LOG_HASH_SIZE];
+    int16_t next[LOG_TRANS_MAX];
+
+    int ndata;
+    uint data[LOG_DATA_MAX]; // Ordered data blocks to write before the commit.
 };
 
 struct log {
@@ -52,16 +154,82 @@ struct log {
     struct disk *disk;         // Disk device.
     int log_start;             // First block number of log.
     int outstanding;           // How many operations are executing.
-    bool committing;           // In commit()?
+    bool closing;              // Closing the running transaction? New operations wait.
 
-    struct logheader lh;
+    struct semaphore commit_sem; // The committer waits here.
+    struct semaphore sync_sem;   // Used to block log_force().
+    bool commit_req;             // Commit without waiting for the window.
+    uint32_t closed;             // Number of transactions closed for commit.
+    uint32_t commits;            // Number of commits done.
+    uint32_t checkpoints;        // Number of checkpoints done.
+    int reserved;                // Blocks reserved by the running operations.
+    uint32_t overruns;           // Blocks written over the budgets.
+    uint32_t overlaps;           // Operations begun during a commit.
+    bool ordered;                // Ordered data?
+
+    /**
+     * Blocks logged or freed since the last checkpoint, hashed by their
+     * block number. They are not written in place as ordered data.
+     */
+    uint8_t replay_map[LOG_REPLAY_BITS / 8];
+
+    uint32_t size;      // Number of blocks of the circular area.
+    int trans_max;      // Maximum number of blocks of a transaction.
+    uint32_t head;      // Area offset of the next transaction.
+    uint32_t tail;      // Area offset of the oldest transaction not checkpointed.
+    uint32_t used;      // Blocks from the tail to the end of the transaction being committed.
+    uint32_t seq;       // Sequence number of the next transaction.
+    uint32_t tail_seq;  // Sequence number of the transaction at the tail.
+
+    struct logheader *lh;  // The running transaction.
+    struct logheader *clh; // The transaction being committed.
 };
 
-void log_begin_op(struct log *);
+/**
+ * Begin an operation writing @nblocks blocks at most. The budget is capped
+ * at the size of a transaction.
+ */
+void log_begin_op(struct log *, int nblocks);
 void log_end_op(struct log *);
 void log_write(struct log *, struct buf *);
 
-void log_init(struct log *, struct disk *disk, int log_start);
+/**
+ * Write a file data block. In ordered mode the block is written in place
+ * before the transaction commits, otherwise it is log_write().
+ */
+void log_write_data(struct log *, struct buf *);
+
+/**
+ * Return true if @block_no can be written in place as ordered data.
+ */
+bool log_block_reusable(struct log *, uint32_t block_no);
+
+/**
+ * Called when @block_no is freed by the running transaction.
+ */
+void log_block_freed(struct log *, uint32_t block_no);
+
+/**
+ * Return the blocks left of the budget of the running operation.
+ */
+int log_budget_left(struct log *);
+
+/**
+ * Commit the operations ended so far and wait until they are on the disk.
+ */
+void log_force(struct log *);
+
+/**
+ * Open the log of nlog blocks from log_start and recover it, without
+ * starting its committer(tests recover log areas of their own).
+ */
+void log_open(struct log *, struct disk *disk, int log_start, int nlog);
+
+/**
+ * Open the log of nlog blocks from log_start, recover it and start its
+ * committer.
+ */
+void log_init(struct log *, struct disk *disk, int log_start, int nlog);
 
 #ifdef __cplusplus
 #if __cplusplus
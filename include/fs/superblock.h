@@ -11,13 +11,27 @@ extern "C" {
 
 /**
  * Disk Layout:
- * ---------------------------------------------------------
- *  Boot   | Super Block | Inodes | BMap     | Data Blocks |
- *  0 - 1  | 1 - 2       | 2 - IN | IN - BN  | BN - end    |
- * ---------------------------------------------------------
+ * -----------------------------------------------------------------------
+ *  Boot   | Super Block | Inodes | IMap     | Log      | BMap  | Data Blocks |
+ *  0 - 1  | 1 - 2       | 2 - IN | IN - IM  | IM - LN  | - BN  | BN - end    |
+ * -----------------------------------------------------------------------
+ *
+ * IMap is the bitmap of the allocated inodes, BMap the bitmap of the
+ * allocated data blocks.
  */
 
-#define SUPER_BLOCK_MAGIC 0xF2E3EACF
+#define SUPER_BLOCK_MAGIC 0xF2E3EAD0
+// The magic of the file systems made before the inode bitmap, the inode flags and the block
+// size were added to the disk format. Their layout differs, so they are refused.
+#define SUPER_BLOCK_MAGIC_OLD 0xF2E3EACF
+
+// The superblock is in the sector 1, the boot sector is the sector 0. The
+// first block after them is the first inode block.
+#define SUPER_BLOCK_LBA 1
+
+// Superblock flags.
+#define SB_FLAGS_ORDERED 0x1 // Ordered-data journaling, see fs/log.h.
+#define SB_FLAGS_EXTENTS 0x2 // New inodes are mapped by extents.
 
 struct superblock {
     uint32_t magic;       // Magic Number
@@ -30,6 +44,9 @@ struct superblock {
     uint32_t bmap_start;  // Block number of the first free bitmap block.
     uint32_t bmap_bytes;  // Number of bmap bytes.
     uint32_t bdata_start; // Block number of the first data block.
+    uint32_t flags;       // SB_FLAGS_*.
+    uint32_t imap_start;  // Block number of the first inode bitmap block.
+    uint32_t block_size;  // Bytes per block.
 };
 
 #ifdef __cplusplus
@@ -10,13 +10,36 @@ extern "C" {
 #endif /* __cplusplus */
 #endif /* __cplusplus */
 
-#define BUF_FLAGS_DIRTY 0x2
-#define BUF_FLAGS_VALID 0x4
+#define BUF_FLAGS_DIRTY     0x2
+#define BUF_FLAGS_VALID     0x4
+#define BUF_FLAGS_BUSY      0x8  // An I/O request is in flight, see buf_submit.
+#define BUF_FLAGS_READAHEAD 0x10 // Read ahead and not yet used.
+#define BUF_FLAGS_DELWRI    0x20 // Newer than the disk, written back later.
+#define BUF_FLAGS_ERROR     0x40 // The last request on the buffer failed.
 
+/**
+ * The file system block size is a multiple of the sector size up to a page,
+ * set by KERNEL_BLOCK_SIZE in build/param.mk. A disk is mounted only if its
+ * superblock was made with the same size.
+ */
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE 512
+#endif
+#if BLOCK_SIZE < 512 || BLOCK_SIZE > 4096 || (BLOCK_SIZE & (BLOCK_SIZE - 1)) != 0
+#error "BLOCK_SIZE must be a power of 2 from 512 to 4096"
+#endif
 
 #define LBA_TO_BLOCK_NO(lba) ((lba) / (BLOCK_SIZE / SECTOR_SIZE))
 
+struct buf;
+struct buf_group;
+
+/**
+ * Completion callback of an asynchronous request. It is called from the
+ * IDE interrupt handler with interrupts disabled, so it must not block.
+ */
+typedef void (*buf_end_io_t)(struct buf *buf, void *arg);
+
 struct buf {
     int flags;
     struct disk *disk;
@@ -25,16 +48,187 @@ struct buf {
     uint32_t refcnt;
     struct buf *prev;
     struct buf *next;
-    struct buf *qnext;
-    uint8_t data[BLOCK_SIZE];
+    struct buf *qnext;       // Next request in the I/O scheduler queue.
+    struct buf *mnext;       // Next buffer merged into the same request.
+    struct buf *fnext;       // Next request in arrival order.
+    uint32_t io_tick;        // When the buffer was queued for I/O.
+    uint32_t dirty_tick;     // When the buffer became BUF_FLAGS_DELWRI.
+    struct buf *hnext;       // Next buffer in the same hash bucket.
+    uint8_t list_id;         // List of the replacement policy holding it.
+    struct buf_group *group; // The page group owning @data.
+    uint8_t *data;           // BLOCK_SIZE bytes.
+
+    struct semaphore io_sem; // Used to wait for the request in flight.
+    buf_end_io_t end_io;     // Called when the request in flight is done.
+    void *end_io_arg;
+};
+
+/**
+ * Statistics of the buffer cache lookups.
+ */
+struct bio_stats {
+    uint32_t lookups; // Number of buf_get() calls.
+    uint32_t hits;    // Lookups that found the block in the cache.
+    uint32_t misses;  // Lookups that had to recycle a buffer.
+    uint32_t probes;  // Buffers compared while searching hash chains.
+
+    uint32_t evictions;  // Blocks dropped to recycle their buffer.
+    uint32_t ghost_hits; // Misses on blocks evicted recently(2Q).
+
+    uint32_t shrunk_pages; // Pages given back by bio_shrink().
+
+    uint32_t ra_issued; // Blocks read ahead.
+    uint32_t ra_hits;   // Read-ahead blocks that were used later.
+    uint32_t ra_wasted; // Read-ahead blocks recycled before being used.
+
+    uint32_t delwri;    // Delayed writes of clean buffers.
+    uint32_t absorbed;  // Delayed writes of buffers not written back yet.
+    uint32_t written;   // Delayed writes written back.
+    uint32_t throttled; // Delayed writes over the per-disk dirty limit.
+
+    uint32_t write_errors; // Failed writes, kept as delayed writes.
 };
 
 void bio_init();
+void bio_get_stats(struct bio_stats *stats);
+
+/**
+ * Return the name of the replacement policy, chosen by KERNEL_BIO_POLICY.
+ */
+const char *bio_get_policy_name();
+
+/**
+ * Return the number of buffers in the cache.
+ */
+uint32_t bio_get_nbufs();
 
+/**
+ * Give up to @npages pages back to the page allocator by dropping clean and
+ * unused buffers from the LRU end of the cache.
+ *
+ * Return the number of pages freed.
+ */
+uint32_t bio_shrink(uint32_t npages);
+
+/**
+ * Return the buffer of the block, read from the disk if it is not cached.
+ *
+ * The kernel panics if the disk fails to read the block, the file system
+ * has no way to go on without it. Use buf_submit() to handle the error.
+ */
 struct buf *buf_read(struct disk *disk, uint32_t block_no);
-void buf_write(struct buf *buf);
+
+/**
+ * Like buf_read(), but the block is not read from the disk because the
+ * caller overwrites all of it. The data is undefined until then.
+ */
+struct buf *buf_overwrite(struct disk *disk, uint32_t block_no);
+
+/**
+ * Start reading the block into the cache without waiting for it. Nothing
+ * is done if the block is already in the cache.
+ */
+void buf_readahead(struct disk *disk, uint32_t block_no);
+
+/**
+ * Scale the read-ahead window @max by the recent hit rate of read-ahead
+ * blocks, so that read-ahead backs off when its blocks are thrown away
+ * unused.
+ */
+uint32_t buf_readahead_window(uint32_t max);
+
+/**
+ * Write the buffer to the disk and wait for it.
+ *
+ * Return 0, or -1 if the disk failed. The buffer is then delayed
+ * (BUF_FLAGS_DELWRI) to be written again later.
+ */
+int buf_write(struct buf *buf);
+
+/**
+ * Mark the buffer to be written later(BUF_FLAGS_DELWRI). Repeated writes of
+ * a block before it is written back cost one disk write. The delayed
+ * buffers are written by bio_sync(), bio_write_blocks(), a writer over the
+ * per-disk limit and, in a kernel built with KERNEL_WRITEBACK, the flusher
+ * thread, which writes the buffers dirty for longer than a few seconds or
+ * when too many buffers are dirty.
+ */
+void buf_write_delayed(struct buf *buf);
+
+/**
+ * Start writing back all delayed buffers of @disk(all disks if NULL).
+ */
+void bio_flush(struct disk *disk);
+
+/**
+ * Write back all delayed buffers of @disk(all disks if NULL) and wait
+ * until they are on the disk.
+ *
+ * Return 0, or -1 if a buffer could not be written, it stays delayed.
+ */
+int bio_sync(struct disk *disk);
+
+/**
+ * Write back the delayed buffers of the given blocks of @disk and wait until
+ * they are on the disk. The blocks not delayed are skipped.
+ *
+ * Return 0, or -1 if a buffer could not be written, it stays delayed.
+ */
+int bio_write_blocks(struct disk *disk, const uint32_t *blocks, uint32_t n);
+
+/**
+ * Return the number of delayed buffers.
+ */
+uint32_t bio_get_ndirty();
+
 void buf_release(struct buf *buf);
 
+/**
+ * Asynchronous buffer I/O.
+ *
+ * Caller must hold the buffer(returned by buf_read or the like) and keeps
+ * holding it while the request is in flight. If the buffer is dirty its
+ * data is written to the disk, otherwise the block is read from the disk.
+ *
+ * Usage:
+ *     buf->data is modified...
+ *     buf_write_async(buf, NULL, NULL);   // Queue as many as you want.
+ *     ...
+ *     buf_wait(buf);
+ *     buf_release(buf);
+ *
+ * @end_io is called with @arg from the IDE interrupt handler when the
+ * request is finished. It may release the buffer if nobody waits for it.
+ *
+ * A failed request sets BUF_FLAGS_ERROR: a read buffer stays invalid, and a
+ * written one is delayed(BUF_FLAGS_DELWRI) to be written again later.
+ */
+void buf_submit(struct buf *buf, buf_end_io_t end_io, void *arg);
+
+static inline void buf_write_async(struct buf *buf, buf_end_io_t end_io, void *arg) {
+    buf->flags |= BUF_FLAGS_DIRTY;
+    buf_submit(buf, end_io, arg);
+}
+
+/**
+ * Block until the request in flight on @buf is finished.
+ *
+ * Return 0, or -1 if the request failed.
+ */
+int buf_wait(struct buf *buf);
+
+/**
+ * Return true if no request is in flight on @buf.
+ */
+static inline bool buf_poll(struct buf *buf) {
+    return (buf->flags & BUF_FLAGS_BUSY) == 0;
+}
+
+/**
+ * Called by the IDE driver when the request on @buf is finished.
+ */
+void buf_io_done(struct buf *buf);
+
 
 #ifdef __cplusplus
 #if __cplusplus
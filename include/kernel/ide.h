@@ -1,8 +1,10 @@
 #ifndef _KERNEL_IDE_H
 #define _KERNEL_IDE_H
 
+#include "iosched.h"
 #include "list.h"
 #include "semaphore.h"
+#include "spinlock.h"
 
 #include "defs.h"
 
@@ -42,6 +44,44 @@ struct disk {
      * Use a log to ensure the atomic operations of file data.
      */
     struct log *log;
+
+    /**
+     * Summary of the free data blocks, see fs/balloc.c.
+     */
+    struct balloc *balloc;
+
+    /**
+     * Sectors moved per interrupt by READ/WRITE MULTIPLE, 0 if the disk
+     * only supports single sector commands.
+     */
+    uint8_t mult_secs;
+
+    /**
+     * Number of delayed buffers(BUF_FLAGS_DELWRI) of the disk.
+     */
+    uint32_t nr_delwri;
+};
+
+/**
+ * What the channel waits for.
+ */
+enum ide_state {
+    IDE_IDLE,
+    IDE_PIO_READ,  // An interrupt per burst of sectors to read.
+    IDE_PIO_WRITE, // An interrupt per burst of sectors taken by the disk.
+    IDE_DMA,       // An interrupt at the end of the transfer.
+};
+
+/**
+ * Counters of a channel.
+ */
+struct ide_stats {
+    uint32_t irqs;        // Interrupts.
+    uint32_t spurious;    // Interrupts while the channel is idle.
+    uint32_t errors;      // Requests failed or retried.
+    uint32_t timeouts;    // Polls given up.
+    uint32_t polls;       // Times the status was polled.
+    uint64_t poll_cycles; // CPU cycles(rdtsc) spent polling the status.
 };
 
 struct ide_channel {
@@ -49,14 +89,33 @@ struct ide_channel {
     uint8_t ide_chan_id;
     uint16_t port_base;
     uint8_t irq_no;
+    uint16_t bmide_base; // Bus master IDE registers, 0 if DMA is not available.
     struct disk devices[2];
-    struct semaphore sem;
+
+    /**
+     * Each channel runs its own requests, so the disks of the two channels
+     * work at the same time. The lock protects the fields below.
+     */
+    struct spinlock lock;
+    struct ioqueue queue; // Requests waiting for the channel.
+
+    /**
+     * The request on the channel is a chain of buffers(linked by
+     * buf->mnext) transferred by one command.
+     */
+    struct buf *inflight; // The first buffer not finished yet.
+    struct buf *xfer;     // The buffer of the next sector to transfer(PIO).
+    uint32_t xfer_sec;    // Sectors of xfer already transferred.
+    enum ide_state state;
+
+    struct ide_stats stats;
 };
 
 void ide_init();
 
 uint8_t get_ide_channel_cnt();
 struct ide_channel *get_ide_channel(uint8_t nr);
+void ide_get_stats(struct ide_channel *ide_chan, struct ide_stats *stats);
 
 /**
  * Rerurn the current disk, which can be used as a file system.
@@ -70,8 +129,18 @@ struct disk *get_current_disk();
  * buffer->data.
  *
  * This function will set buffer->data = valid if success.
+ *
+ * Return 0, or -1 if the disk failed(BUF_FLAGS_ERROR), see buf_wait().
+ */
+int iderw(struct buf *buf);
+
+/**
+ * Like iderw, but queue the request and return without waiting for it.
+ * The interrupt handler calls buf_io_done() once the request is finished.
+ *
+ * Use buf_submit() instead, which prepares the buffer for the completion.
  */
-void iderw(struct buf *buf);
+void ide_submit(struct buf *buf);
 
 #ifdef __cplusplus
 #if __cplusplus
@@ -0,0 +1,140 @@
+#ifndef _KERNEL_IOSCHED_H
+#define _KERNEL_IOSCHED_H
+
+#include "defs.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * The I/O scheduler decides in which order the queued buffers are sent to
+ * the disk. It sits between iderw()/buf_submit() and idestart().
+ *
+ * A request is a buffer, and buffers of contiguous blocks are merged into
+ * one request(linked by buf->mnext) when they are queued, so the disk can
+ * transfer them back to back.
+ *
+ * Policies:
+ *     noop:     first come, first served.
+ *     clook:    C-LOOK elevator, serves requests in ascending block order
+ *               and jumps back to the lowest block at the end.
+ *     deadline: C-LOOK, but a request waiting longer than its deadline is
+ *               served first.
+ */
+
+// Maximum number of blocks merged into one request.
+#define IOSCHED_MAX_MERGE 32
+
+struct buf;
+
+/**
+ * Counters of a policy. Latencies are in ticks, from the time a buffer is
+ * queued until its I/O is finished.
+ */
+struct iosched_stats {
+    uint32_t requests;      // Buffers queued.
+    uint32_t merges;        // Buffers merged into another request.
+    uint32_t dispatches;    // Requests sent to the disk.
+    uint32_t read_blocks;   // Blocks read.
+    uint32_t write_blocks;  // Blocks written.
+    uint32_t total_latency; // Sum of the latencies of all finished buffers.
+    uint32_t max_latency;   // Maximum latency of a buffer.
+};
+
+/**
+ * Queued requests of a disk channel. The meaning of the lists depends on
+ * the policy.
+ */
+struct ioqueue {
+    struct iosched *sched;
+    struct buf *head;      // Requests, in the order of the policy.
+    struct buf *fifo;      // Requests in arrival order(deadline only).
+    struct buf *fifo_tail;
+    uint32_t pos;          // The block following the last dispatched request.
+    uint32_t nr;           // Number of queued requests.
+};
+
+struct iosched {
+    char *name;
+
+    /**
+     * Queue the buffer or merge it into a queued request.
+     */
+    void (*add)(struct ioqueue *q, struct buf *buf);
+
+    /**
+     * Remove and return the next request to be served. The queue is not
+     * empty.
+     */
+    struct buf *(*dispatch)(struct ioqueue *q);
+
+    struct iosched_stats stats;
+};
+
+/**
+ * Select the policy used by new queues, KERNEL_IOSCHED by default.
+ */
+void iosched_init();
+
+/**
+ * Return the policy with the given name or NULL.
+ */
+struct iosched *iosched_lookup(const char *name);
+
+/**
+ * Return the policy selected at boot.
+ */
+struct iosched *iosched_get_current();
+
+void iosched_get_stats(struct iosched *sched, struct iosched_stats *stats);
+
+void ioqueue_init(struct ioqueue *q);
+void ioqueue_add(struct ioqueue *q, struct buf *buf);
+struct buf *ioqueue_dispatch(struct ioqueue *q);
+static inline bool ioqueue_empty(struct ioqueue *q) {
+    return q->nr == 0;
+}
+
+/**
+ * Called by the driver when the I/O on @buf, which is one of the buffers
+ * of a dispatched request, is finished.
+ */
+void ioqueue_complete(struct ioqueue *q, struct buf *buf);
+
+/**
+ * Helpers for the policies.
+ */
+
+/**
+ * Append @buf to the request @rq if it continues @rq on the disk. Return
+ * true if @buf is merged.
+ */
+bool iosched_try_merge(struct ioqueue *q, struct buf *rq, struct buf *buf);
+
+/**
+ * Insert @buf into q->head sorted by block number, or merge it into a
+ * request. Return false if @buf is merged.
+ */
+bool iosched_sorted_add(struct ioqueue *q, struct buf *buf);
+
+/**
+ * Remove and return the first request in q->head at or after q->pos, or
+ * the first one if there is none(C-LOOK).
+ */
+struct buf *iosched_sorted_next(struct ioqueue *q);
+
+/**
+ * Remove the request @rq from q->head.
+ */
+void iosched_sorted_remove(struct ioqueue *q, struct buf *rq);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+#endif /* _KERNEL_IOSCHED_H */
@@ -0,0 +1,55 @@
+#ifndef _KERNEL_PCI_H
+#define _KERNEL_PCI_H
+
+#include "defs.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * Offsets in the PCI configuration space.
+ */
+#define PCI_COMMAND    0x04
+#define PCI_CLASS_REV  0x08
+#define PCI_BAR(n)     (0x10 + (n) * 4)
+
+#define PCI_COMMAND_IO     0x1
+#define PCI_COMMAND_MASTER 0x4
+
+#define PCI_BAR_IO 0x1
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
+
+/**
+ * Address of a function on the PCI bus.
+ */
+struct pci_dev {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+};
+
+/**
+ * Access the configuration space through the ports 0xCF8/0xCFC(mechanism #1).
+ * @offset must be 4-byte aligned.
+ */
+uint32_t pci_read_config(struct pci_dev *pdev, uint8_t offset);
+void pci_write_config(struct pci_dev *pdev, uint8_t offset, uint32_t value);
+
+/**
+ * Find the first function of the given class and subclass on the bus.
+ * Return true and fill @pdev if one is found.
+ */
+bool pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *pdev);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+#endif /* _KERNEL_PCI_H */
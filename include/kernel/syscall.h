@@ -18,5 +18,6 @@
 #define SYS_chdir  14
 #define SYS_dup    15
 #define SYS_pipe   16
+#define SYS_fsync  17
 
 #endif /* _KERNEL_SYSCALL_H */
\ No newline at end of file
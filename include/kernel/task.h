@@ -65,6 +65,7 @@ struct task_struct {
     int exit_status;             // Exit status code.
     struct file *ofiles[NOFILE]; // Open files
     struct inode *cwd;           // Current directory.
+    int log_budget;              // Log blocks left to the running operation.
 
     struct list_node ready_queue_node;
     struct list_node sem_wait_node;
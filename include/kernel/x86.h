@@ -52,6 +52,10 @@ static inline void outb(uint16_t port, uint8_t data) {
     asm volatile("outb %b0, %w1" : : "a"(data), "Nd"(port));
 }
 
+static inline void outl(uint16_t port, uint32_t data) {
+    asm volatile("outl %0, %w1" : : "a"(data), "Nd"(port));
+}
+
 static inline void outsw(uint16_t port, const void *addr, uint32_t cnt) {
     asm volatile("cld; rep outsw" : "+S"(addr), "+c"(cnt) : "d"(port));
 }
@@ -69,6 +73,12 @@ static inline uint8_t inb(uint16_t port) {
     return data;
 }
 
+static inline uint32_t inl(uint16_t port) {
+    uint32_t data;
+    asm volatile("inl %w1, %0" : "=a"(data) : "Nd"(port));
+    return data;
+}
+
 static inline void insw(uint16_t port, const void *dest, uint32_t cnt) {
     asm volatile("cld; rep insw" : "+D"(dest), "+c"(cnt) : "d"(port) : "memory");
 }
@@ -80,6 +90,13 @@ static inline void insl(uint16_t port, const void *addr, uint32_t cnt) {
                  : "memory", "cc");
 }
 
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    // rdtsc, encoded by hand because the kernel is built with -march=i386.
+    asm volatile(".byte 0x0f, 0x31" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
 static inline void lidt(void *idt, uint16_t size) {
     volatile uint16_t idtr[3];
     idtr[0] = size - 1;
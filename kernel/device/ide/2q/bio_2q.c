@@ -0,0 +1,196 @@
+#include "../bio_policy.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * 2Q(Johnson and Shasha, VLDB'94), resistant to scans.
+ *
+ * A block read for the first time goes to the FIFO A1in. When it is
+ * evicted from A1in its number is remembered in the ghost list A1out. Only
+ * a block read again while it is in A1out goes to the LRU list Am. So a
+ * large file read once only goes through A1in and does not push the hot
+ * inode and bitmap blocks out of Am.
+ */
+#define Q_FREE  0 // Buffers without a block.
+#define Q_A1IN  1
+#define Q_AM    2
+#define NQUEUES 3
+
+// A1in holds 1/A1IN_RATIO of the cache, A1out remembers 1/A1OUT_RATIO.
+#define A1IN_RATIO  4
+#define A1OUT_RATIO 2
+
+/**
+ * A1out is a FIFO of hashes of the block numbers, with a counting table to
+ * test whether a block is in it. A collision only makes a block go to Am
+ * a little early. The entry of a block moved to Am is replaced by
+ * GHOST_NONE.
+ */
+#define MAX_GHOSTS  1024
+#define GHOST_SLOTS 4096
+#define GHOST_NONE  0
+
+static struct buf queues[NQUEUES];
+static uint32_t qlen[NQUEUES];
+static uint32_t kin;
+
+// The queues in eviction order, see twoq_first().
+static int order[NQUEUES];
+
+static uint32_t ghosts[MAX_GHOSTS];
+static uint32_t ghost_head, ghost_cnt, kout;
+static uint16_t ghost_slots[GHOST_SLOTS];
+
+static inline uint32_t ghost_key(struct disk *disk, uint32_t block_no) {
+    uint32_t h = ((uint32_t) disk >> 4) * 0x9E3779B1 ^ block_no * 0x85EBCA6B;
+    // Never GHOST_NONE.
+    return (h ^ (h >> 16)) | 1;
+}
+
+static void ghost_add(uint32_t key) {
+    if (ghost_cnt == kout) {
+        if (ghosts[ghost_head] != GHOST_NONE) {
+            ghost_slots[ghosts[ghost_head] % GHOST_SLOTS]--;
+        }
+        ghost_head = (ghost_head + 1) % kout;
+        ghost_cnt--;
+    }
+    ghosts[(ghost_head + ghost_cnt) % kout] = key;
+    ghost_slots[key % GHOST_SLOTS]++;
+    ghost_cnt++;
+}
+
+static inline bool ghost_contains(uint32_t key) {
+    return ghost_slots[key % GHOST_SLOTS] != 0;
+}
+
+/**
+ * Remove the newest entry of @key from A1out, if it is not a collision.
+ */
+static void ghost_remove(uint32_t key) {
+    for (uint32_t i = ghost_cnt; i > 0; i--) {
+        uint32_t *g = &ghosts[(ghost_head + i - 1) % kout];
+        if (*g == key) {
+            *g = GHOST_NONE;
+            ghost_slots[key % GHOST_SLOTS]--;
+            return;
+        }
+    }
+}
+
+static inline void q_push_head(int q, struct buf *buf) {
+    buf->list_id = q;
+    bufq_push_head(&queues[q], buf);
+    qlen[q]++;
+}
+
+static inline void q_remove(struct buf *buf) {
+    bufq_remove(buf);
+    qlen[buf->list_id]--;
+}
+
+static void twoq_init(uint32_t target_bufs) {
+    for (int q = 0; q < NQUEUES; q++) {
+        bufq_init(&queues[q]);
+        qlen[q] = 0;
+    }
+    kin = target_bufs / A1IN_RATIO;
+    kout = target_bufs / A1OUT_RATIO;
+    if (kout > MAX_GHOSTS) {
+        kout = MAX_GHOSTS;
+    }
+    ghost_head = ghost_cnt = 0;
+}
+
+static void twoq_add(struct buf *buf) {
+    buf->list_id = Q_FREE;
+    bufq_push_tail(&queues[Q_FREE], buf);
+    qlen[Q_FREE]++;
+}
+
+static void twoq_del(struct buf *buf) {
+    q_remove(buf);
+}
+
+static void twoq_hit(struct buf *buf) {
+    // Hits in A1in are usually correlated references(e.g. several inodes
+    // in one block), they do not make the block hot.
+    if (buf->list_id == Q_AM) {
+        q_remove(buf);
+        q_push_head(Q_AM, buf);
+    }
+}
+
+static void twoq_release(struct buf *buf) {
+}
+
+static bool twoq_replace(struct buf *buf, struct disk *disk, uint32_t block_no) {
+    if (buf->disk != NULL && buf->list_id == Q_A1IN) {
+        ghost_add(ghost_key(buf->disk, buf->block_no));
+    }
+    q_remove(buf);
+
+    uint32_t key = ghost_key(disk, block_no);
+    if (ghost_contains(key)) {
+        ghost_remove(key);
+        q_push_head(Q_AM, buf);
+        return true;
+    }
+    q_push_head(Q_A1IN, buf);
+    return false;
+}
+
+/**
+ * Return the tail of the first non-empty queue from order[@i].
+ */
+static struct buf *first_from(int i) {
+    for (; i < NQUEUES; i++) {
+        struct buf *head = &queues[order[i]];
+        if (!bufq_empty(head)) {
+            return head->prev;
+        }
+    }
+    return NULL;
+}
+
+static struct buf *twoq_first() {
+    // Take from A1in while it is over its share, otherwise from Am.
+    order[0] = Q_FREE;
+    order[1] = qlen[Q_A1IN] > kin ? Q_A1IN : Q_AM;
+    order[2] = qlen[Q_A1IN] > kin ? Q_AM : Q_A1IN;
+    return first_from(0);
+}
+
+static struct buf *twoq_next(struct buf *buf) {
+    if (buf->prev != &queues[buf->list_id]) {
+        return buf->prev;
+    }
+    for (int i = 0; i < NQUEUES; i++) {
+        if (order[i] == buf->list_id) {
+            return first_from(i + 1);
+        }
+    }
+    return NULL;
+}
+
+struct bio_policy bio_policy = {
+    .name = "2Q",
+    .init = twoq_init,
+    .add = twoq_add,
+    .del = twoq_del,
+    .hit = twoq_hit,
+    .release = twoq_release,
+    .replace = twoq_replace,
+    .first = twoq_first,
+    .next = twoq_next,
+};
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
@@ -1,8 +1,14 @@
 #include "kernel/buf.h"
 #include "kernel/ide.h"
+#include "kernel/memory.h"
 #include "kernel/spinlock.h"
+#include "kernel/task.h"
+#include "kernel/timer.h"
 
 #include "stdio.h"
+#include "string.h"
+
+#include "bio_policy.h"
 
 #ifdef __cplusplus
 #if __cplusplus
@@ -10,86 +16,728 @@ extern "C" {
 #endif /* __cplusplus */
 #endif /* __cplusplus */
 
-#define NBUF 40
+/**
+ * Get the bytes of the memory from this function.
+ * @see kernel/entry.asm
+ */
+extern uint32_t get_total_memory();
+
+#define NBUF_MIN 40 // Number of buffers allocated at boot time.
+
+// The buffer cache may use 1/BIO_MEM_RATIO of the main memory.
+#define BIO_MEM_RATIO 16
+
+// The cache stops growing when fewer free pages than this are left.
+#define BIO_RESERVE_PAGES 256
+
+/**
+ * Write-back. The flusher wakes up every BIO_FLUSH_INTERVAL ticks and
+ * writes the buffers delayed for longer than BIO_DIRTY_EXPIRE ticks, or
+ * the oldest ones when more than 1/BIO_DIRTY_RATIO of the cache is
+ * delayed. A writer over the per-disk limit(1/BIO_DISK_DIRTY_RATIO of the
+ * cache) starts the write back itself.
+ */
+#define BIO_FLUSH_INTERVAL   500
+#define BIO_DIRTY_EXPIRE     3000
+#define BIO_DIRTY_RATIO      10
+#define BIO_DISK_DIRTY_RATIO 4
+#define BIO_FLUSH_BATCH      32
+#define BIO_WRITEBACK_ALL    ((uint32_t) -1)
+
+#define BUFS_PER_PAGE     (PG_SIZE / BLOCK_SIZE)
+#define BUCKETS_PER_PAGE  (PG_SIZE / sizeof(struct buf *))
+#define MAX_BUCKET_PAGES  16
+
+/**
+ * The buffers are allocated page by page. A group describes the
+ * BUFS_PER_PAGE buffers whose data lives in one physical page.
+ *
+ * The group headers are never freed, a shrunk group only gives its page
+ * back and is kept on bcache.spare_groups for the next growth. So the
+ * shrinker, which is called by palloc(), never calls kfree().
+ */
+struct buf_group {
+    struct list_node node;
+    void *page;
+    struct buf bufs[BUFS_PER_PAGE];
+};
 
+/**
+ * The buffer cache keeps all buffers on the lists of the replacement
+ * policy(see bio_policy.h) and indexes the buffers holding a block by
+ * (disk, block_no) in a hash table, so that a lookup does not walk the
+ * lists.
+ *
+ * The cache grows from free pages on misses until it reaches
+ * bcache.target_bufs and is shrunk again by bio_shrink() when the
+ * system runs out of memory.
+ */
 struct {
     struct spinlock lock;
-    struct buf bufs[NBUF];
-    struct buf head;
+    struct list groups;       // Groups owning a page.
+    struct list spare_groups; // Groups without a page.
+    uint32_t nbufs;           // Number of buffers in the cache.
+    uint32_t target_bufs;     // The cache grows up to this size on misses.
+
+    struct buf **buckets[MAX_BUCKET_PAGES];
+    uint32_t nbuckets; // Number of hash buckets (a power of 2).
+
+    // Read-ahead outcomes, halved regularly to follow the recent workload.
+    uint32_t ra_recent_hits;
+    uint32_t ra_recent_wasted;
+
+    uint32_t ndirty;           // Number of delayed buffers.
+    struct semaphore flush_sem; // The flusher waits here while ndirty is 0.
+
+    struct bio_stats stats;
 } bcache;
 
-static inline void buf_insert_to_head(struct buf *buf) {
-    buf->next = bcache.head.next;
-    buf->prev = &bcache.head;
-    bcache.head.next->prev = buf;
-    bcache.head.next = buf;
+#ifdef KERNEL_WRITEBACK
+static void bio_flusher(void *data);
+#endif
+
+static inline struct buf **buf_bucket(struct disk *disk, uint32_t block_no) {
+    uint32_t h = (((uint32_t) disk >> 4) ^ block_no ^ (block_no >> 12)) & (bcache.nbuckets - 1);
+    return &bcache.buckets[h / BUCKETS_PER_PAGE][h % BUCKETS_PER_PAGE];
 }
 
-static inline void buf_unlinked(struct buf *buf) {
-    buf->next->prev = buf->prev;
-    buf->prev->next = buf->next;
+static inline void buf_hash_insert(struct buf *buf) {
+    struct buf **bucket = buf_bucket(buf->disk, buf->block_no);
+    buf->hnext = *bucket;
+    *bucket = buf;
 }
 
-void bio_init() {
-    spinlock_init(&bcache.lock);
+static inline void buf_hash_remove(struct buf *buf) {
+    struct buf **pp = buf_bucket(buf->disk, buf->block_no);
+    while (*pp != NULL) {
+        if (*pp == buf) {
+            *pp = buf->hnext;
+            buf->hnext = NULL;
+            return;
+        }
+        pp = &(*pp)->hnext;
+    }
+}
 
-    bcache.head.next = &bcache.head;
-    bcache.head.prev = &bcache.head;
+static inline struct buf *buf_hash_lookup(struct disk *disk, uint32_t block_no) {
+    struct buf *b;
+    for (b = *buf_bucket(disk, block_no); b != NULL; b = b->hnext) {
+        bcache.stats.probes++;
+        if (b->disk == disk && b->block_no == block_no) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static inline bool buf_idle(struct buf *buf) {
+    return buf->refcnt == 0 && (buf->flags & (BUF_FLAGS_DIRTY | BUF_FLAGS_DELWRI)) == 0;
+}
 
-    for (struct buf *b = bcache.bufs; b < bcache.bufs + NBUF; b++) {
+/**
+ * Account the outcome of a read-ahead block. Caller must hold bcache.lock.
+ */
+static inline void buf_readahead_done(struct buf *buf, bool used) {
+    buf->flags &= ~BUF_FLAGS_READAHEAD;
+    if (used) {
+        bcache.stats.ra_hits++;
+        bcache.ra_recent_hits++;
+    } else {
+        bcache.stats.ra_wasted++;
+        bcache.ra_recent_wasted++;
+    }
+    if (bcache.ra_recent_hits + bcache.ra_recent_wasted >= 256) {
+        bcache.ra_recent_hits /= 2;
+        bcache.ra_recent_wasted /= 2;
+    }
+}
+
+/**
+ * Add a page of new buffers to the cache. The policy recycles buffers
+ * without a block first.
+ *
+ * Return false if there is no memory.
+ */
+static bool bio_grow() {
+    struct buf_group *group = NULL;
+    void *page;
+    bool int_save;
+
+    if (get_free_page_cnt() < BIO_RESERVE_PAGES && bcache.nbufs >= NBUF_MIN) {
+        return false;
+    }
+    if ((page = get_free_page()) == NULL) {
+        return false;
+    }
+
+    spinlock_acquire(&bcache.lock, &int_save);
+    if (!list_empty(&bcache.spare_groups)) {
+        group = NODE_AS(struct buf_group, list_pop(&bcache.spare_groups), node);
+    }
+    spinlock_release(&bcache.lock, &int_save);
+
+    if (group == NULL && (group = kalloc(sizeof *group)) == NULL) {
+        free_page(page);
+        return false;
+    }
+
+    group->page = page;
+    for (int i = 0; i < BUFS_PER_PAGE; i++) {
+        struct buf *b = &group->bufs[i];
         sem_init(&b->sem, 1, "block_cache");
+        sem_init(&b->io_sem, 0, "block_io");
+        b->end_io = NULL;
+        b->end_io_arg = NULL;
+        b->flags = 0;
         b->refcnt = 0;
         b->disk = NULL;
         b->block_no = 0;
         b->qnext = NULL;
-        buf_insert_to_head(b);
+        b->mnext = NULL;
+        b->fnext = NULL;
+        b->dirty_tick = 0;
+        b->hnext = NULL;
+        b->list_id = 0;
+        b->group = group;
+        b->data = page + i * BLOCK_SIZE;
+    }
+
+    spinlock_acquire(&bcache.lock, &int_save);
+    list_push(&bcache.groups, &group->node);
+    for (int i = 0; i < BUFS_PER_PAGE; i++) {
+        bio_policy.add(&group->bufs[i]);
+    }
+    bcache.nbufs += BUFS_PER_PAGE;
+    spinlock_release(&bcache.lock, &int_save);
+    return true;
+}
+
+/**
+ * Return true if all buffers in the group can be dropped.
+ */
+static bool buf_group_idle(struct buf_group *group) {
+    for (int i = 0; i < BUFS_PER_PAGE; i++) {
+        if (!buf_idle(&group->bufs[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t bio_shrink(uint32_t npages) {
+    struct buf *b, *next;
+    uint32_t freed = 0;
+    bool int_save;
+
+    spinlock_acquire(&bcache.lock, &int_save);
+    // Walk from the best victim of the policy and free the pages whose
+    // buffers are all clean and unused.
+    for (b = bio_policy.first(); b != NULL && freed < npages; b = next) {
+        next = bio_policy.next(b);
+        if (bcache.nbufs <= NBUF_MIN || !buf_idle(b) || !buf_group_idle(b->group)) {
+            continue;
+        }
+
+        struct buf_group *group = b->group;
+        while (next != NULL && next->group == group) {
+            next = bio_policy.next(next);
+        }
+        for (int i = 0; i < BUFS_PER_PAGE; i++) {
+            struct buf *gb = &group->bufs[i];
+            if (gb->disk != NULL) {
+                buf_hash_remove(gb);
+            }
+            if (gb->flags & BUF_FLAGS_READAHEAD) {
+                buf_readahead_done(gb, false);
+            }
+            bio_policy.del(gb);
+        }
+        list_unlinked(&group->node);
+        list_push(&bcache.spare_groups, &group->node);
+        bcache.nbufs -= BUFS_PER_PAGE;
+        bcache.stats.shrunk_pages++;
+
+        free_page(group->page);
+        group->page = NULL;
+        freed++;
     }
+    spinlock_release(&bcache.lock, &int_save);
+    return freed;
+}
+
+const char *bio_get_policy_name() {
+    return bio_policy.name;
+}
+
+uint32_t bio_get_nbufs() {
+    return bcache.nbufs;
+}
+
+void bio_init() {
+    uint32_t total_pages;
+
+    spinlock_init(&bcache.lock);
+
+    list_init(&bcache.groups);
+    list_init(&bcache.spare_groups);
+    memset(&bcache.stats, 0, sizeof bcache.stats);
+    bcache.nbufs = 0;
+    bcache.ndirty = 0;
+    sem_init(&bcache.flush_sem, 0, "bio_flush");
+
+    total_pages = get_total_memory() / PG_SIZE;
+    bcache.target_bufs = total_pages / BIO_MEM_RATIO * BUFS_PER_PAGE;
+    if (bcache.target_bufs < NBUF_MIN) {
+        bcache.target_bufs = NBUF_MIN;
+    }
+    bio_policy.init(bcache.target_bufs);
+
+    // About two buffers per hash bucket once the cache is full.
+    bcache.nbuckets = 1;
+    while (bcache.nbuckets * 2 < bcache.target_bufs &&
+           bcache.nbuckets < MAX_BUCKET_PAGES * BUCKETS_PER_PAGE) {
+        bcache.nbuckets <<= 1;
+    }
+    for (uint32_t i = 0; i < ROUND_UP(bcache.nbuckets, BUCKETS_PER_PAGE); i++) {
+        if ((bcache.buckets[i] = get_zeroed_free_page()) == NULL) {
+            PANIC("bio_init: no memory for the hash table");
+        }
+    }
+
+    while (bcache.nbufs < NBUF_MIN) {
+        if (!bio_grow()) {
+            PANIC("bio_init: no memory for buffers");
+        }
+    }
+
+    printk("    Buffer cache: %d buffers, up to %d buffers (%d KB), %s replacement\n",
+           bcache.nbufs, bcache.target_bufs, bcache.target_bufs * BLOCK_SIZE / 1024,
+           bio_policy.name);
+
+#ifdef KERNEL_WRITEBACK
+    kthread_start(bio_flusher, NULL, 10, "bio_flush");
+#endif
+}
+
+/**
+ * Clear BUF_FLAGS_DELWRI. Caller must hold bcache.lock.
+ */
+static inline void buf_clear_delwri(struct buf *buf) {
+    buf->flags &= ~BUF_FLAGS_DELWRI;
+    buf->disk->nr_delwri--;
+    bcache.ndirty--;
+}
+
+/**
+ * Set BUF_FLAGS_DELWRI and wake up the flusher. Caller must hold
+ * bcache.lock.
+ */
+static inline void buf_set_delwri(struct buf *buf) {
+    buf->flags |= BUF_FLAGS_DELWRI;
+    buf->dirty_tick = get_tick_count();
+    buf->disk->nr_delwri++;
+    bcache.ndirty++;
+    if (!list_empty(&bcache.flush_sem.waiting_tasks)) {
+        sem_signal(&bcache.flush_sem);
+    }
+}
+
+/**
+ * Nobody waits for a buffer written back in the background, unlock it once
+ * it is written.
+ */
+static void buf_writeback_end_io(struct buf *buf, void *arg) {
+    buf_release(buf);
+}
+
+/**
+ * Write back the buffers of @batch, referenced by the caller, which are
+ * still delayed once they are locked. If @wait is true, wait for the
+ * writes and add the failed ones to *@nfailed.
+ *
+ * Return the number of buffers written.
+ */
+static uint32_t bio_write_batch(struct buf **batch, uint32_t n, bool wait, uint32_t *nfailed) {
+    uint32_t nsubmitted = 0;
+    bool int_save;
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct buf *b = batch[i];
+        sem_wait(&b->sem);
+
+        spinlock_acquire(&bcache.lock, &int_save);
+        bool delwri = (b->flags & (BUF_FLAGS_DELWRI | BUF_FLAGS_DIRTY)) == BUF_FLAGS_DELWRI;
+        if (delwri) {
+            buf_clear_delwri(b);
+            bcache.stats.written++;
+        }
+        spinlock_release(&bcache.lock, &int_save);
+
+        if (!delwri) {
+            // Written back or logged by someone else in the meantime.
+            buf_release(b);
+        } else if (wait) {
+            buf_write_async(b, NULL, NULL);
+            batch[nsubmitted++] = b;
+        } else {
+            buf_write_async(b, buf_writeback_end_io, NULL);
+            nsubmitted++;
+        }
+    }
+    if (wait) {
+        for (uint32_t i = 0; i < nsubmitted; i++) {
+            if (buf_wait(batch[i]) < 0) {
+                (*nfailed)++;
+            }
+            buf_release(batch[i]);
+        }
+    }
+    return nsubmitted;
+}
+
+/**
+ * Write back up to @max delayed buffers of @disk(all disks if NULL) which
+ * are delayed for at least @min_age ticks, oldest first(from the LRU end).
+ *
+ * Buffers held by somebody are skipped unless @wait is true, then the
+ * function also waits for the writes and stops at the first batch with a
+ * failed write, counted in *@nfailed. Buffers being modified under a log
+ * transaction(BUF_FLAGS_DIRTY) are always skipped.
+ *
+ * Return the number of buffers written.
+ */
+static uint32_t bio_writeback(struct disk *disk, uint32_t max, uint32_t min_age, bool wait,
+                              uint32_t *nfailed) {
+    struct buf *batch[BIO_FLUSH_BATCH];
+    uint32_t written = 0;
+    bool int_save;
+
+    while (written < max && (!wait || *nfailed == 0)) {
+        uint32_t n = 0;
+        uint32_t now = get_tick_count();
+
+        spinlock_acquire(&bcache.lock, &int_save);
+        for (struct buf *b = bio_policy.first(); b != NULL && n < BIO_FLUSH_BATCH &&
+                                                 written + n < max;
+             b = bio_policy.next(b)) {
+            if ((b->flags & (BUF_FLAGS_DELWRI | BUF_FLAGS_DIRTY)) != BUF_FLAGS_DELWRI ||
+                (disk != NULL && b->disk != disk) || now - b->dirty_tick < min_age ||
+                (b->refcnt != 0 && (!wait || sem_holding(&b->sem)))) {
+                continue;
+            }
+            b->refcnt++;
+            batch[n++] = b;
+        }
+        spinlock_release(&bcache.lock, &int_save);
+
+        if (n == 0) {
+            break;
+        }
+
+        written += bio_write_batch(batch, n, wait, nfailed);
+    }
+    return written;
+}
+
+#ifdef KERNEL_WRITEBACK
+static void bio_flusher(void *data) {
+    bool int_save;
+
+    for (;;) {
+        INT_LOCK(int_save);
+        while (bcache.ndirty == 0) {
+            sem_wait(&bcache.flush_sem);
+        }
+        INT_UNLOCK(int_save);
+
+        task_sleep(BIO_FLUSH_INTERVAL);
+
+        bio_writeback(NULL, BIO_WRITEBACK_ALL, BIO_DIRTY_EXPIRE, false, NULL);
+
+        uint32_t limit = bcache.nbufs / BIO_DIRTY_RATIO;
+        if (bcache.ndirty > limit) {
+            bio_writeback(NULL, bcache.ndirty - limit / 2, 0, false, NULL);
+        }
+    }
+}
+#endif
+
+void buf_write_delayed(struct buf *buf) {
+    ASSERT(sem_holding(&buf->sem));
+    ASSERT(buf_poll(buf));
+
+    struct disk *disk = buf->disk;
+    bool throttle;
+    bool int_save;
+
+    spinlock_acquire(&bcache.lock, &int_save);
+    buf->flags &= ~BUF_FLAGS_DIRTY;
+    buf->flags |= BUF_FLAGS_VALID;
+    if (buf->flags & BUF_FLAGS_DELWRI) {
+        bcache.stats.absorbed++;
+    } else {
+        buf_set_delwri(buf);
+        bcache.stats.delwri++;
+    }
+    throttle = disk->nr_delwri > bcache.nbufs / BIO_DISK_DIRTY_RATIO;
+    if (throttle) {
+        bcache.stats.throttled++;
+    }
+    spinlock_release(&bcache.lock, &int_save);
+
+    if (throttle) {
+        bio_writeback(disk, BIO_FLUSH_BATCH, 0, false, NULL);
+    }
+}
+
+void bio_flush(struct disk *disk) {
+    bio_writeback(disk, BIO_WRITEBACK_ALL, 0, false, NULL);
+}
+
+int bio_sync(struct disk *disk) {
+    uint32_t nfailed = 0;
+    bio_writeback(disk, BIO_WRITEBACK_ALL, 0, true, &nfailed);
+    return nfailed == 0 ? 0 : -1;
+}
+
+int bio_write_blocks(struct disk *disk, const uint32_t *blocks, uint32_t n) {
+    struct buf *batch[BIO_FLUSH_BATCH];
+    uint32_t nfailed = 0;
+    bool int_save;
+
+    for (uint32_t i = 0; i < n;) {
+        uint32_t nb = 0;
+
+        spinlock_acquire(&bcache.lock, &int_save);
+        for (; i < n && nb < BIO_FLUSH_BATCH; i++) {
+            struct buf *b = buf_hash_lookup(disk, blocks[i]);
+            if (b == NULL ||
+                (b->flags & (BUF_FLAGS_DELWRI | BUF_FLAGS_DIRTY)) != BUF_FLAGS_DELWRI) {
+                continue;
+            }
+            uint32_t j;
+            for (j = 0; j < nb && batch[j] != b; j++) {
+            }
+            if (j == nb) {
+                b->refcnt++;
+                batch[nb++] = b;
+            }
+        }
+        spinlock_release(&bcache.lock, &int_save);
+
+        bio_write_batch(batch, nb, true, &nfailed);
+    }
+    return nfailed == 0 ? 0 : -1;
+}
+
+uint32_t bio_get_ndirty() {
+    return bcache.ndirty;
 }
 
 static struct buf *buf_get(struct disk *disk, uint32_t block_no) {
     struct buf *b;
     bool int_save;
+    bool grown = false;
 
     spinlock_acquire(&bcache.lock, &int_save);
+    bcache.stats.lookups++;
 
-    for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-        if (b->disk == disk && b->block_no == block_no) {
+    for (;;) {
+        if ((b = buf_hash_lookup(disk, block_no)) != NULL) {
+            bcache.stats.hits++;
+            bio_policy.hit(b);
             b->refcnt++;
             spinlock_release(&bcache.lock, &int_save);
             sem_wait(&b->sem);
             return b;
         }
-    }
 
-    for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-        if (b->refcnt == 0 && (b->flags & BUF_FLAGS_DIRTY) == 0) {
-            b->refcnt = 1;
-            b->flags = 0;
-            b->disk = disk;
-            b->block_no = block_no;
+        // Grow the cache instead of recycling a buffer until the target
+        // size is reached.
+        if (!grown && bcache.nbufs < bcache.target_bufs) {
             spinlock_release(&bcache.lock, &int_save);
-            sem_wait(&b->sem);
-            return b;
+            grown = bio_grow();
+            spinlock_acquire(&bcache.lock, &int_save);
+            if (grown) {
+                continue;
+            }
+        }
+
+        for (b = bio_policy.first(); b != NULL; b = bio_policy.next(b)) {
+            if (buf_idle(b)) {
+                if (bio_policy.replace(b, disk, block_no)) {
+                    bcache.stats.ghost_hits++;
+                }
+                if (b->disk != NULL) {
+                    buf_hash_remove(b);
+                    bcache.stats.evictions++;
+                }
+                if (b->flags & BUF_FLAGS_READAHEAD) {
+                    buf_readahead_done(b, false);
+                }
+                bcache.stats.misses++;
+                b->refcnt = 1;
+                b->flags = 0;
+                b->disk = disk;
+                b->block_no = block_no;
+                buf_hash_insert(b);
+                spinlock_release(&bcache.lock, &int_save);
+                sem_wait(&b->sem);
+                return b;
+            }
         }
+
+        // All buffers are in use, grow beyond the target size, or make
+        // the delayed buffers clean.
+        spinlock_release(&bcache.lock, &int_save);
+        if (!bio_grow()) {
+            if (bcache.ndirty == 0) {
+                PANIC("buf_get: no buffers");
+            }
+            bio_sync(NULL);
+        }
+        grown = true;
+        spinlock_acquire(&bcache.lock, &int_save);
     }
+}
 
-    spinlock_release(&bcache.lock, &int_save);
-    PANIC("buf_get: no buffers");
-    return NULL;
+struct buf *buf_overwrite(struct disk *disk, uint32_t block_no) {
+    struct buf *buf = buf_get(disk, block_no);
+    if (buf->flags & BUF_FLAGS_READAHEAD) {
+        bool int_save;
+        spinlock_acquire(&bcache.lock, &int_save);
+        buf_readahead_done(buf, true);
+        spinlock_release(&bcache.lock, &int_save);
+    }
+    buf->flags |= BUF_FLAGS_VALID;
+    return buf;
 }
 
 struct buf *buf_read(struct disk *disk, uint32_t block_no) {
     struct buf *buf = buf_get(disk, block_no);
-    if ((buf->flags & BUF_FLAGS_VALID) == 0) {
-        iderw(buf);
+    if (buf->flags & BUF_FLAGS_READAHEAD) {
+        bool int_save;
+        spinlock_acquire(&bcache.lock, &int_save);
+        buf_readahead_done(buf, true);
+        spinlock_release(&bcache.lock, &int_save);
+    }
+    if ((buf->flags & BUF_FLAGS_VALID) == 0 && iderw(buf) < 0) {
+        PANIC("buf_read: cannot read block %d of %s", block_no, disk->name);
     }
     return buf;
 }
 
-void buf_write(struct buf *buf) {
+void buf_submit(struct buf *buf, buf_end_io_t end_io, void *arg) {
+    ASSERT(sem_holding(&buf->sem));
+    ASSERT(buf_poll(buf));
+
+    buf->flags |= BUF_FLAGS_BUSY;
+    buf->flags &= ~BUF_FLAGS_ERROR;
+    buf->end_io = end_io;
+    buf->end_io_arg = arg;
+    ide_submit(buf);
+}
+
+int buf_wait(struct buf *buf) {
+    bool int_save;
+    INT_LOCK(int_save);
+    while (!buf_poll(buf)) {
+        sem_wait(&buf->io_sem);
+    }
+    INT_UNLOCK(int_save);
+    return (buf->flags & BUF_FLAGS_ERROR) ? -1 : 0;
+}
+
+void buf_io_done(struct buf *buf) {
+    buf_end_io_t end_io = buf->end_io;
+    void *arg = buf->end_io_arg;
+
+    if ((buf->flags & (BUF_FLAGS_ERROR | BUF_FLAGS_DIRTY)) ==
+        (BUF_FLAGS_ERROR | BUF_FLAGS_DIRTY)) {
+        // Keep the data of a failed write, it is written again later.
+        bool int_save;
+        spinlock_acquire(&bcache.lock, &int_save);
+        buf->flags &= ~BUF_FLAGS_DIRTY;
+        if ((buf->flags & BUF_FLAGS_DELWRI) == 0) {
+            buf_set_delwri(buf);
+        }
+        bcache.stats.write_errors++;
+        spinlock_release(&bcache.lock, &int_save);
+    }
+
+    buf->flags &= ~BUF_FLAGS_BUSY;
+    buf->end_io = NULL;
+    buf->end_io_arg = NULL;
+
+    if (!list_empty(&buf->io_sem.waiting_tasks)) {
+        sem_signal(&buf->io_sem);
+    }
+    if (end_io != NULL) {
+        end_io(buf, arg);
+    }
+}
+
+/**
+ * Nobody waits for a read-ahead block, unlock it once it is read.
+ */
+static void buf_readahead_end_io(struct buf *buf, void *arg) {
+    buf_release(buf);
+}
+
+void buf_readahead(struct disk *disk, uint32_t block_no) {
+    struct buf *buf;
+    bool int_save;
+
+    spinlock_acquire(&bcache.lock, &int_save);
+    buf = buf_hash_lookup(disk, block_no);
+    spinlock_release(&bcache.lock, &int_save);
+    if (buf != NULL) {
+        return;
+    }
+
+    buf = buf_get(disk, block_no);
+    if (buf->flags & BUF_FLAGS_VALID) {
+        // Someone else has read the block in the meantime.
+        buf_release(buf);
+        return;
+    }
+
+    spinlock_acquire(&bcache.lock, &int_save);
+    buf->flags |= BUF_FLAGS_READAHEAD;
+    bcache.stats.ra_issued++;
+    spinlock_release(&bcache.lock, &int_save);
+
+    buf_submit(buf, buf_readahead_end_io, NULL);
+}
+
+uint32_t buf_readahead_window(uint32_t max) {
+    uint32_t hits = bcache.ra_recent_hits;
+    uint32_t total = hits + bcache.ra_recent_wasted;
+    if (total < 16) {
+        // Not enough samples.
+        return max;
+    }
+    uint32_t window = max * hits / total;
+    return window == 0 ? 1 : window;
+}
+
+int buf_write(struct buf *buf) {
     ASSERT(sem_holding(&buf->sem));
+    if (buf->flags & BUF_FLAGS_DELWRI) {
+        bool int_save;
+        spinlock_acquire(&bcache.lock, &int_save);
+        buf_clear_delwri(buf);
+        spinlock_release(&bcache.lock, &int_save);
+    }
     buf->flags |= BUF_FLAGS_DIRTY;
-    iderw(buf);
+    return iderw(buf);
+}
+
+void bio_get_stats(struct bio_stats *stats) {
+    bool int_save;
+    spinlock_acquire(&bcache.lock, &int_save);
+    memcpy(stats, &bcache.stats, sizeof *stats);
+    spinlock_release(&bcache.lock, &int_save);
 }
 
 void buf_release(struct buf *buf) {
@@ -100,8 +748,7 @@ void buf_release(struct buf *buf) {
 
     buf->refcnt--;
     if (buf->refcnt == 0) {
-        buf_unlinked(buf);
-        buf_insert_to_head(buf);
+        bio_policy.release(buf);
     }
 
     spinlock_release(&bcache.lock, &int_save);
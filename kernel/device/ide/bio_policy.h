@@ -0,0 +1,101 @@
+#ifndef _KERNEL_BIO_POLICY_H
+#define _KERNEL_BIO_POLICY_H
+
+#include "kernel/buf.h"
+
+#include "stdbool.h"
+#include "stdint.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * The replacement policy of the buffer cache decides which buffer is
+ * recycled on a miss. It keeps the buffers on its own lists(linked by
+ * buf->prev/next) and is chosen at build time by KERNEL_BIO_POLICY, like
+ * the task schedular.
+ *
+ * All functions are called with the bcache lock held.
+ */
+struct bio_policy {
+    char *name;
+
+    void (*init)(uint32_t target_bufs);
+
+    /**
+     * A new buffer without a block joins the cache, or leaves it because
+     * its page is given back.
+     */
+    void (*add)(struct buf *buf);
+    void (*del)(struct buf *buf);
+
+    /**
+     * A lookup found the buffer.
+     */
+    void (*hit)(struct buf *buf);
+
+    /**
+     * The last reference to the buffer is released.
+     */
+    void (*release)(struct buf *buf);
+
+    /**
+     * The idle buffer is recycled to hold (@disk, @block_no). buf->disk and
+     * buf->block_no still describe the old block(buf->disk is NULL if the
+     * buffer holds none).
+     *
+     * Return true if the new block was recently evicted.
+     */
+    bool (*replace)(struct buf *buf, struct disk *disk, uint32_t block_no);
+
+    /**
+     * Walk the buffers in eviction order, the best victim first. NULL ends
+     * the walk.
+     */
+    struct buf *(*first)();
+    struct buf *(*next)(struct buf *buf);
+};
+
+extern struct bio_policy bio_policy;
+
+/**
+ * Doubly linked lists of buffers with a sentinel, for the policies.
+ */
+static inline void bufq_init(struct buf *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static inline bool bufq_empty(struct buf *head) {
+    return head->next == head;
+}
+
+static inline void bufq_push_head(struct buf *head, struct buf *buf) {
+    buf->next = head->next;
+    buf->prev = head;
+    head->next->prev = buf;
+    head->next = buf;
+}
+
+static inline void bufq_push_tail(struct buf *head, struct buf *buf) {
+    buf->prev = head->prev;
+    buf->next = head;
+    head->prev->next = buf;
+    head->prev = buf;
+}
+
+static inline void bufq_remove(struct buf *buf) {
+    buf->next->prev = buf->prev;
+    buf->prev->next = buf->next;
+}
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+#endif /* _KERNEL_BIO_POLICY_H */
@@ -2,9 +2,13 @@
 #include "kernel/buf.h"
 #include "kernel/debug.h"
 #include "kernel/iopic.h"
+#include "kernel/iosched.h"
+#include "kernel/memory.h"
+#include "kernel/pci.h"
 #include "kernel/trap.h"
 #include "kernel/x86.h"
 #include "stdio.h"
+#include "string.h"
 
 #ifdef __cplusplus
 #if __cplusplus
@@ -13,7 +17,9 @@ extern "C" {
 #endif /* __cplusplus */
 
 /**
- * This file implements a simple PIO-based(Programmed I/O) IDE driver
+ * This file implements a simple IDE driver. Requests are transferred by the
+ * PCI bus master IDE controller(DMA) when there is one, otherwise by PIO
+ * (Programmed I/O).
  */
 
 #define PORT_DATA(ide_chan)       ((ide_chan)->port_base + 0)
@@ -31,20 +37,63 @@ extern "C" {
 #define IDE_BSY  0b10000000
 #define IDE_DRDY 0b01000000
 #define IDE_DF   0b00100000
+#define IDE_DRQ  0b00001000
 #define IDE_ERR  0b00000001
 
-#define CMD_READ  0x20
-#define CMD_WRITE 0x30
-#define CMD_RDMUL 0xC4
-#define CMD_WRMUL 0xC5
-
-#define GET_CMD_WRITE(secs) (((secs) == 1) ? CMD_WRITE : CMD_WRMUL)
-#define GET_CMD_READ(secs)  (((secs) == 1) ? CMD_READ : CMD_RDMUL)
+#define CMD_READ    0x20
+#define CMD_WRITE   0x30
+#define CMD_RDMUL   0xC4
+#define CMD_WRMUL   0xC5
+#define CMD_SETMULT 0xC6
+#define CMD_RDDMA   0xC8
+#define CMD_WRDMA   0xCA
 
 #define BIT_DEV_MBS   0B10100000
 #define BIT_DEV_LBA   0B01000000
 #define BIT_DEV_SLAVE 0B00010000
 
+/**
+ * Bus master IDE registers, see "Programming Interface for Bus Master IDE
+ * Controller".
+ */
+#define PORT_BM_CMD(ide_chan)    ((ide_chan)->bmide_base + 0)
+#define PORT_BM_STATUS(ide_chan) ((ide_chan)->bmide_base + 2)
+#define PORT_BM_PRDT(ide_chan)   ((ide_chan)->bmide_base + 4)
+
+#define BM_CMD_START 0x1
+#define BM_CMD_READ  0x8 // The controller writes to memory.
+
+#define BM_STATUS_ACTIVE 0x1
+#define BM_STATUS_ERR    0x2
+#define BM_STATUS_INTR   0x4
+
+/**
+ * Physical Region Descriptor, one per buffer of a request. A region must
+ * not cross a 64K boundary, which a buffer never does.
+ */
+struct ide_prd {
+    uint32_t addr;
+    uint16_t size;
+    uint16_t flags;
+} __attribute__((packed));
+
+#define PRD_EOT 0x8000
+
+/**
+ * The sector count register is 8 bits, 0 means 256 sectors.
+ */
+#define IDE_MAX_SECTORS 256
+
+/**
+ * Sectors per interrupt asked for with SET MULTIPLE MODE.
+ */
+#define IDE_MULT_SECTORS 16
+
+/**
+ * Maximum number of status reads of ide_poll().
+ */
+#define IDE_POLL_LIMIT 100000
+
 /**
  * Gets the number of hard disks from the 0x475(provided by BIOS).
  */
@@ -53,8 +102,12 @@ extern "C" {
 struct ide_channel ide_chans[2] = {{.ide_chan_id = 0, .port_base = 0x1f0, .irq_no = 0xe},
                                    {.ide_chan_id = 1, .port_base = 0x170, .irq_no = 0xf}};
 
-static struct spinlock idelock;
-static struct buf *idequeue;
+/**
+ * PRD tables of the channels. A table is aligned to its size so it does
+ * not cross a 64K boundary either.
+ */
+static struct ide_prd ide_prdt[2][IOSCHED_MAX_MERGE]
+    __attribute__((aligned(IOSCHED_MAX_MERGE * sizeof(struct ide_prd))));
 
 static struct disk *cur_disk = NULL;
 
@@ -72,79 +125,282 @@ static inline void select_secs(struct disk *disk, uint32_t lba, uint32_t secs) {
                                  ((lba >> 24) & 0xF));
 }
 
-static int idewait(struct ide_channel *ide_chan) {
-    uint32_t r;
+/**
+ * Poll the status until BSY is clear and (status & mask) == want, or an
+ * error is reported. Give up after IDE_POLL_LIMIT reads. Return the status,
+ * or -1 on timeout.
+ *
+ * The driver is interrupt driven, this is only used where the disk has no
+ * interrupt to raise: before the first burst of a PIO write, and when BSY
+ * is still set in the interrupt.
+ */
+static int ide_poll(struct ide_channel *ide_chan, uint8_t mask, uint8_t want) {
+    uint64_t start = rdtsc();
+    uint32_t spins = IDE_POLL_LIMIT;
+    uint8_t r;
+
+    do {
+        r = inb(PORT_ALT_STATUS(ide_chan));
+        if ((r & IDE_BSY) == 0 && ((r & mask) == want || (r & (IDE_DF | IDE_ERR)) != 0)) {
+            break;
+        }
+    } while (--spins > 0);
+
+    ide_chan->stats.polls++;
+    ide_chan->stats.poll_cycles += rdtsc() - start;
+    if (spins == 0) {
+        ide_chan->stats.timeouts++;
+        return -1;
+    }
+    return r;
+}
 
-    while (((r = inb(PORT_STATUS(ide_chan))) & (IDE_BSY | IDE_DRDY)) != IDE_DRDY)
-        /* Nothing to do */;
+/**
+ * Number of sectors moved by one insl/outsl burst.
+ */
+static inline uint32_t ide_burst_secs(struct disk *disk) {
+    return disk->mult_secs != 0 ? disk->mult_secs : 1;
+}
 
-    if ((r & (IDE_DF | IDE_ERR)) != 0) {
+/**
+ * Move up to a burst of sectors between the disk and the buffers of the
+ * in-flight request of the channel, starting at ide_chan->xfer.
+ */
+static void ide_transfer(struct ide_channel *ide_chan, bool write) {
+    const uint32_t sectors_per_block = BLOCK_SIZE / SECTOR_SIZE;
+    uint32_t secs = ide_burst_secs(ide_chan->xfer->disk);
+
+    while (secs-- > 0 && ide_chan->xfer != NULL) {
+        uint8_t *data = ide_chan->xfer->data + ide_chan->xfer_sec * SECTOR_SIZE;
+        if (write) {
+            outsl(PORT_DATA(ide_chan), data, SECTOR_SIZE / 4);
+        } else {
+            insl(PORT_DATA(ide_chan), data, SECTOR_SIZE / 4);
+        }
+        if (++ide_chan->xfer_sec == sectors_per_block) {
+            ide_chan->xfer = ide_chan->xfer->mnext;
+            ide_chan->xfer_sec = 0;
+        }
+    }
+}
+
+/**
+ * Start a DMA transfer of the chain of buffers.
+ */
+static void ide_dma_start(struct buf *buf, uint32_t lba, uint32_t sectors) {
+    struct ide_channel *ide_chan = buf->disk->ide_chan;
+    struct ide_prd *prd = ide_prdt[ide_chan->ide_chan_id];
+    bool write = (buf->flags & BUF_FLAGS_DIRTY) != 0;
+    int n = 0;
+
+    for (struct buf *b = buf; b != NULL; b = b->mnext, n++) {
+        ASSERT(n < IOSCHED_MAX_MERGE);
+        prd[n].addr = (uint32_t) KV2P(b->data);
+        prd[n].size = BLOCK_SIZE;
+        prd[n].flags = 0;
+    }
+    prd[n - 1].flags = PRD_EOT;
+
+    ide_chan->state = IDE_DMA;
+    outl(PORT_BM_PRDT(ide_chan), (uint32_t) KV2P(prd));
+    outb(PORT_BM_CMD(ide_chan), write ? 0 : BM_CMD_READ);
+    // Clear the error and interrupt bits(write 1 to clear).
+    outb(PORT_BM_STATUS(ide_chan), BM_STATUS_ERR | BM_STATUS_INTR);
+
+    select_secs(buf->disk, lba, sectors & 0xFF);
+    outb(PORT_CMD(ide_chan), write ? CMD_WRDMA : CMD_RDDMA);
+    outb(PORT_BM_CMD(ide_chan), (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+}
+
+/**
+ * Stop the DMA transfer. Return 0 if the whole request is transferred.
+ */
+static int ide_dma_end(struct ide_channel *ide_chan) {
+    uint8_t bm_status = inb(PORT_BM_STATUS(ide_chan));
+    outb(PORT_BM_CMD(ide_chan), 0);
+    // Reading the status register acknowledges the interrupt of the disk.
+    uint8_t status = inb(PORT_STATUS(ide_chan));
+    outb(PORT_BM_STATUS(ide_chan), BM_STATUS_ERR | BM_STATUS_INTR);
+
+    if ((bm_status & BM_STATUS_ERR) != 0 || (status & (IDE_DF | IDE_ERR)) != 0) {
         return -1;
     }
     return 0;
 }
 
 /**
- * Start to synchronize the buf.
+ * Finish the buffers of the in-flight request of the channel before @until.
+ */
+static void ide_finish(struct ide_channel *ide_chan, struct buf *until) {
+    while (ide_chan->inflight != until) {
+        struct buf *buf = ide_chan->inflight;
+        ioqueue_complete(&ide_chan->queue, buf);
+
+        // Make the buffer valid and remove the dirty flag, unless the
+        // request failed.
+        if ((buf->flags & BUF_FLAGS_ERROR) == 0) {
+            buf->flags |= BUF_FLAGS_VALID;
+            buf->flags &= ~BUF_FLAGS_DIRTY;
+        }
+
+        ide_chan->inflight = buf->mnext;
+        buf->mnext = NULL;
+
+        // Wakeup the task wating for this buffer and run its callback.
+        buf_io_done(buf);
+    }
+}
+
+/**
+ * Give up the in-flight request of the channel after the disk reported an
+ * error(@status) or did not answer(@status < 0). Its buffers are finished
+ * with BUF_FLAGS_ERROR: a read one stays invalid and a written one dirty.
+ */
+static void ide_error(struct ide_channel *ide_chan, int status) {
+    struct buf *buf = ide_chan->inflight;
+    ide_chan->stats.errors++;
+    printk("%s: %s on block %d, status 0x%x\n", ide_chan->name, status < 0 ? "timeout" : "error",
+           buf->block_no, status < 0 ? 0 : status);
+
+    for (struct buf *b = buf; b != NULL; b = b->mnext) {
+        b->flags |= BUF_FLAGS_ERROR;
+    }
+
+    ide_chan->state = IDE_IDLE;
+    ide_chan->xfer = NULL;
+    ide_finish(ide_chan, NULL);
+}
+
+/**
+ * Start to synchronize the chain of buffers with one command.
  */
 static void idestart(struct buf *buf) {
     ASSERT(buf != NULL);
 
-    struct ide_channel *ide_chan = buf->disk->ide_chan;
-    int sectors_per_block = BLOCK_SIZE / SECTOR_SIZE;
-    int sector_lba = buf->block_no * sectors_per_block;
+    struct disk *disk = buf->disk;
+    struct ide_channel *ide_chan = disk->ide_chan;
+    uint32_t sectors_per_block = BLOCK_SIZE / SECTOR_SIZE;
+    uint32_t sector_lba = buf->block_no * sectors_per_block;
+    uint32_t sectors = 0;
+    bool multiple = disk->mult_secs != 0;
+
+    for (struct buf *b = buf; b != NULL; b = b->mnext) {
+        sectors += sectors_per_block;
+    }
+    ASSERT(sectors <= IDE_MAX_SECTORS);
+
+    ide_chan->inflight = ide_chan->xfer = buf;
+    ide_chan->xfer_sec = 0;
 
-    ASSERT(sectors_per_block < 8);
+    if (ide_chan->bmide_base != 0) {
+        ide_dma_start(buf, sector_lba, sectors);
+        return;
+    }
 
-    select_secs(buf->disk, sector_lba, sectors_per_block);
+    select_secs(disk, sector_lba, sectors & 0xFF);
     if (buf->flags & BUF_FLAGS_DIRTY) {
-        // write buffer to the disk.
-        outb(PORT_CMD(ide_chan), GET_CMD_WRITE(sectors_per_block));
-        outsl(PORT_DATA(ide_chan), buf->data, BLOCK_SIZE / 4);
+        // write the first burst to the disk, the following ones are written
+        // by ide_intr_handler once the disk has taken the previous one.
+        ide_chan->state = IDE_PIO_WRITE;
+        outb(PORT_CMD(ide_chan), multiple ? CMD_WRMUL : CMD_WRITE);
+        int status = ide_poll(ide_chan, IDE_DRQ, IDE_DRQ);
+        if (status < 0 || (status & (IDE_DF | IDE_ERR)) != 0) {
+            ide_error(ide_chan, status);
+            return;
+        }
+        ide_transfer(ide_chan, true);
     } else {
         // send a read command to IDE.
         // see ide_intr_handler.
-        outb(PORT_CMD(ide_chan), GET_CMD_READ(sectors_per_block));
+        ide_chan->state = IDE_PIO_READ;
+        outb(PORT_CMD(ide_chan), multiple ? CMD_RDMUL : CMD_READ);
+    }
+}
+
+/**
+ * Start requests chosen by the I/O scheduler until one is on the disk or
+ * the queue is empty.
+ */
+static void ide_start_next(struct ide_channel *ide_chan) {
+    while (ide_chan->inflight == NULL && !ioqueue_empty(&ide_chan->queue)) {
+        idestart(ioqueue_dispatch(&ide_chan->queue));
     }
 }
 
 /**
- * IDE interrupt handler.
+ * IDE interrupt handler. The disk interrupts once per burst of sectors.
  */
 static void ide_intr_handler(struct trap_frame *tf) {
     ASSERT(tf->intr_nr == IRQ_START_VEC_NR + 0xe || tf->intr_nr == IRQ_START_VEC_NR + 0xf);
 
-    bool int_save;
-    spinlock_acquire(&idelock, &int_save);
-
+    // Route the interrupt to its channel.
     uint8_t ide_chan_idx = tf->intr_nr - (IRQ_START_VEC_NR + 0xe);
     struct ide_channel *ide_chan = &ide_chans[ide_chan_idx];
 
-    struct buf *buf = idequeue;
-    if (buf == NULL) {
-        spinlock_release(&idelock, &int_save);
+    bool int_save;
+    spinlock_acquire(&ide_chan->lock, &int_save);
+
+    ide_chan->stats.irqs++;
+    if (ide_chan->state == IDE_IDLE) {
+        // Nothing was asked, acknowledge the interrupt.
+        inb(PORT_STATUS(ide_chan));
+        ide_chan->stats.spurious++;
+        spinlock_release(&ide_chan->lock, &int_save);
         return;
     }
 
-    if ((buf->flags & BUF_FLAGS_DIRTY) == 0 && idewait(ide_chan) == 0) {
-        // The buffer is invalid. read from disk.
-        insl(PORT_DATA(ide_chan), buf->data, BLOCK_SIZE / 4);
-    }
-    // Make the buffer valid and remove the dirty flag.
-    buf->flags |= BUF_FLAGS_VALID;
-    buf->flags &= ~BUF_FLAGS_DIRTY;
-
-    idequeue = buf->qnext;
-    buf->qnext = NULL;
+    struct buf *buf = ide_chan->inflight;
+    ASSERT(buf != NULL);
 
-    // Wakeup the task wating for this buffer.
-    sem_signal(&ide_chan->sem);
+    if (ide_chan->state == IDE_DMA) {
+        ide_chan->state = IDE_IDLE;
+        if (ide_dma_end(ide_chan) == 0) {
+            ide_finish(ide_chan, NULL);
+        } else {
+            // Fall back to PIO and transfer the request again.
+            printk("%s: DMA error, fall back to PIO\n", ide_chan->name);
+            ide_chan->stats.errors++;
+            ide_chan->bmide_base = 0;
+            idestart(buf);
+        }
+        ide_start_next(ide_chan);
+        spinlock_release(&ide_chan->lock, &int_save);
+        return;
+    }
 
-    if (idequeue != NULL) {
-        idestart(idequeue);
+    // Reading the status register acknowledges the interrupt. The disk has
+    // normally cleared BSY already, poll a little if it has not.
+    int status = inb(PORT_STATUS(ide_chan));
+    if ((status & IDE_BSY) != 0) {
+        status = ide_poll(ide_chan, 0, 0);
     }
+    // Data must be ready unless the last burst of a write was taken.
+    bool need_data = ide_chan->state == IDE_PIO_READ || ide_chan->xfer != NULL;
+
+    if (status < 0 || (status & (IDE_DF | IDE_ERR)) != 0 ||
+        (need_data && (status & IDE_DRQ) == 0)) {
+        ide_error(ide_chan, status);
+    } else if (ide_chan->state == IDE_PIO_WRITE) {
+        // The disk has taken the previous burst, send the next one.
+        struct buf *written = ide_chan->xfer;
+        if (ide_chan->xfer != NULL) {
+            ide_transfer(ide_chan, true);
+        } else {
+            ide_chan->state = IDE_IDLE;
+        }
+        ide_finish(ide_chan, written);
+    } else {
+        // The buffer is invalid. read from disk.
+        ide_transfer(ide_chan, false);
+        if (ide_chan->xfer == NULL) {
+            ide_chan->state = IDE_IDLE;
+        }
+        ide_finish(ide_chan, ide_chan->xfer);
+    }
+
+    ide_start_next(ide_chan);
 
-    spinlock_release(&idelock, &int_save);
+    spinlock_release(&ide_chan->lock, &int_save);
 }
 
 struct ide_channel *get_ide_channel(uint8_t nr) {
@@ -152,34 +408,95 @@ struct ide_channel *get_ide_channel(uint8_t nr) {
     return &ide_chans[nr];
 }
 
-void iderw(struct buf *buf) {
+void ide_get_stats(struct ide_channel *ide_chan, struct ide_stats *stats) {
+    bool int_save;
+    spinlock_acquire(&ide_chan->lock, &int_save);
+    memcpy(stats, &ide_chan->stats, sizeof *stats);
+    spinlock_release(&ide_chan->lock, &int_save);
+}
+
+/**
+ * Hand the buffer to the I/O scheduler of its channel and start a request
+ * if the channel is idle. Caller must hold the lock of the channel.
+ */
+static void ide_enqueue(struct ide_channel *ide_chan, struct buf *buf) {
     ASSERT(sem_holding(&buf->sem));
     ASSERT((buf->flags & (BUF_FLAGS_VALID | BUF_FLAGS_DIRTY)) != BUF_FLAGS_VALID);
+
+    ioqueue_add(&ide_chan->queue, buf);
+    ide_start_next(ide_chan);
+}
+
+void ide_submit(struct buf *buf) {
+    struct ide_channel *ide_chan = buf->disk->ide_chan;
     bool int_save;
-    spinlock_acquire(&idelock, &int_save);
+    spinlock_acquire(&ide_chan->lock, &int_save);
+    ide_enqueue(ide_chan, buf);
+    spinlock_release(&ide_chan->lock, &int_save);
+}
 
-    if (idequeue == NULL) {
-        idequeue = buf;
-        idestart(buf);
-    } else {
-        struct buf *prev;
-        for (prev = idequeue; prev->qnext != NULL; prev = prev->qnext)
-            ;
-        prev->qnext = buf;
+int iderw(struct buf *buf) {
+    buf_submit(buf, NULL, NULL);
+    // Block self. Wait for request to finish.
+    return buf_wait(buf);
+}
+
+
+/**
+ * Ask the disk to move IDE_MULT_SECTORS sectors per interrupt with
+ * READ/WRITE MULTIPLE. Keep single sector commands if the disk refuses.
+ */
+static void ide_set_multiple(struct disk *disk) {
+    struct ide_channel *ide_chan = disk->ide_chan;
+
+    disk->mult_secs = 0;
+    select_secs(disk, 0, IDE_MULT_SECTORS);
+    outb(PORT_CMD(ide_chan), CMD_SETMULT);
+    int status = ide_poll(ide_chan, 0, 0);
+    inb(PORT_STATUS(ide_chan));
+
+    if (status >= 0 && (status & (IDE_DF | IDE_ERR)) == 0) {
+        disk->mult_secs = IDE_MULT_SECTORS;
     }
+    printk("%s: %d sectors per interrupt\n", disk->name, ide_burst_secs(disk));
+}
 
-    // Block self. Wait for request to finish.
-    while ((buf->flags & (BUF_FLAGS_VALID | BUF_FLAGS_DIRTY)) != BUF_FLAGS_VALID) {
-        sem_wait(&buf->disk->ide_chan->sem);
+/**
+ * Find the bus master IDE controller on the PCI bus and let the channels
+ * use DMA. The channels keep using PIO if there is none.
+ */
+static void ide_dma_init() {
+    struct pci_dev pdev;
+
+    ide_chans[0].bmide_base = ide_chans[1].bmide_base = 0;
+    if (!pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &pdev)) {
+        printk("ide: no PCI IDE controller, use PIO\n");
+        return;
     }
 
-    spinlock_release(&idelock, &int_save);
-}
+    uint32_t bar = pci_read_config(&pdev, PCI_BAR(4));
+    if ((bar & PCI_BAR_IO) == 0 || (bar & ~0x3) == 0) {
+        printk("ide: no bus master support, use PIO\n");
+        return;
+    }
 
+    uint32_t cmd = pci_read_config(&pdev, PCI_COMMAND);
+    pci_write_config(&pdev, PCI_COMMAND, cmd | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+    ide_chans[0].bmide_base = bar & ~0x3;
+    ide_chans[1].bmide_base = (bar & ~0x3) + 8;
+    printk("ide: bus master DMA at 0x%x\n", ide_chans[0].bmide_base);
+}
 
 static void init_ide_chan(struct ide_channel *ide_chan) {
     sprintf(ide_chan->name, "ide_%d", ide_chan->ide_chan_id);
-    sem_init(&ide_chan->sem, 0, ide_chan->name);
+
+    spinlock_init(&ide_chan->lock);
+    ioqueue_init(&ide_chan->queue);
+    ide_chan->inflight = ide_chan->xfer = NULL;
+    ide_chan->xfer_sec = 0;
+    ide_chan->state = IDE_IDLE;
+    memset(&ide_chan->stats, 0, sizeof ide_chan->stats);
 
     setup_irq_handler(ide_chan->irq_no, ide_intr_handler);
     enable_irq(ide_chan->irq_no);
@@ -194,6 +511,12 @@ static void init_ide_chan(struct ide_channel *ide_chan) {
         hd->sb = NULL;
         hd->log = NULL;
 
+        hd->mult_secs = 0;
+        hd->nr_delwri = 0;
+        if (ide_chan->ide_chan_id * 2 + dev_no < HARD_DISK_CNT) {
+            ide_set_multiple(hd);
+        }
+
         // Don't use the main hard disk as a file system.
         if (dev_no != 0 || ide_chan->ide_chan_id != 0) {
             cur_disk = hd;
@@ -216,8 +539,8 @@ uint8_t get_ide_channel_cnt() {
 
 void ide_init() {
     printk("ide_init start...\n");
-    spinlock_init(&idelock);
-    idequeue = NULL;
+    iosched_init();
+    ide_dma_init();
 
     uint8_t ide_chan_cnt = get_ide_channel_cnt();
     for (uint8_t nr = 0; nr < ide_chan_cnt; nr++) {
@@ -0,0 +1,170 @@
+#include "kernel/iosched.h"
+#include "kernel/buf.h"
+#include "kernel/debug.h"
+#include "kernel/timer.h"
+
+#include "string.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+#ifndef KERNEL_IOSCHED
+#define KERNEL_IOSCHED "clook"
+#endif
+
+extern struct iosched noop_iosched;
+extern struct iosched clook_iosched;
+extern struct iosched deadline_iosched;
+
+static struct iosched *ioscheds[] = {&noop_iosched, &clook_iosched, &deadline_iosched};
+
+static struct iosched *cur_iosched = &noop_iosched;
+
+struct iosched *iosched_lookup(const char *name) {
+    for (uint32_t i = 0; i < sizeof ioscheds / sizeof *ioscheds; i++) {
+        if (strcmp(ioscheds[i]->name, name) == 0) {
+            return ioscheds[i];
+        }
+    }
+    return NULL;
+}
+
+struct iosched *iosched_get_current() {
+    return cur_iosched;
+}
+
+void iosched_init() {
+    struct iosched *sched = iosched_lookup(KERNEL_IOSCHED);
+    if (sched == NULL) {
+        printk("    Unknown I/O scheduler: %s, use noop.\n", KERNEL_IOSCHED);
+        sched = &noop_iosched;
+    }
+    cur_iosched = sched;
+    printk("    I/O scheduler: %s\n", sched->name);
+}
+
+void iosched_get_stats(struct iosched *sched, struct iosched_stats *stats) {
+    bool int_save;
+    INT_LOCK(int_save);
+    memcpy(stats, &sched->stats, sizeof *stats);
+    INT_UNLOCK(int_save);
+}
+
+void ioqueue_init(struct ioqueue *q) {
+    q->sched = cur_iosched;
+    q->head = NULL;
+    q->fifo = NULL;
+    q->fifo_tail = NULL;
+    q->pos = 0;
+    q->nr = 0;
+}
+
+void ioqueue_add(struct ioqueue *q, struct buf *buf) {
+    buf->qnext = NULL;
+    buf->mnext = NULL;
+    buf->fnext = NULL;
+    buf->io_tick = get_tick_count();
+    q->sched->stats.requests++;
+    q->sched->add(q, buf);
+}
+
+struct buf *ioqueue_dispatch(struct ioqueue *q) {
+    ASSERT(!ioqueue_empty(q));
+    struct buf *rq = q->sched->dispatch(q);
+    struct buf *last = rq;
+    while (last->mnext != NULL) {
+        last = last->mnext;
+    }
+    rq->qnext = NULL;
+    rq->fnext = NULL;
+    q->pos = last->block_no + 1;
+    q->nr--;
+    q->sched->stats.dispatches++;
+    return rq;
+}
+
+void ioqueue_complete(struct ioqueue *q, struct buf *buf) {
+    struct iosched_stats *stats = &q->sched->stats;
+    uint32_t latency = get_tick_count() - buf->io_tick;
+
+    if (buf->flags & BUF_FLAGS_DIRTY) {
+        stats->write_blocks++;
+    } else {
+        stats->read_blocks++;
+    }
+    stats->total_latency += latency;
+    if (latency > stats->max_latency) {
+        stats->max_latency = latency;
+    }
+}
+
+bool iosched_try_merge(struct ioqueue *q, struct buf *rq, struct buf *buf) {
+    struct buf *last = rq;
+    uint32_t n = 1;
+
+    if (rq->disk != buf->disk || (rq->flags & BUF_FLAGS_DIRTY) != (buf->flags & BUF_FLAGS_DIRTY)) {
+        return false;
+    }
+    while (last->mnext != NULL) {
+        last = last->mnext;
+        n++;
+    }
+    if (n >= IOSCHED_MAX_MERGE || last->block_no + 1 != buf->block_no) {
+        return false;
+    }
+
+    last->mnext = buf;
+    q->sched->stats.merges++;
+    return true;
+}
+
+bool iosched_sorted_add(struct ioqueue *q, struct buf *buf) {
+    struct buf **pp;
+    for (pp = &q->head; *pp != NULL; pp = &(*pp)->qnext) {
+        if (iosched_try_merge(q, *pp, buf)) {
+            return false;
+        }
+        if ((*pp)->block_no > buf->block_no) {
+            break;
+        }
+    }
+    buf->qnext = *pp;
+    *pp = buf;
+    q->nr++;
+    return true;
+}
+
+struct buf *iosched_sorted_next(struct ioqueue *q) {
+    struct buf *rq;
+    for (rq = q->head; rq != NULL; rq = rq->qnext) {
+        if (rq->block_no >= q->pos) {
+            break;
+        }
+    }
+    if (rq == NULL) {
+        // Reach the end of the disk, go back to the lowest request.
+        rq = q->head;
+    }
+    iosched_sorted_remove(q, rq);
+    return rq;
+}
+
+void iosched_sorted_remove(struct ioqueue *q, struct buf *rq) {
+    struct buf **pp;
+    for (pp = &q->head; *pp != NULL; pp = &(*pp)->qnext) {
+        if (*pp == rq) {
+            *pp = rq->qnext;
+            return;
+        }
+    }
+    PANIC("iosched_sorted_remove: no such request.");
+}
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
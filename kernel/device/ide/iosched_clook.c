@@ -0,0 +1,34 @@
+#include "kernel/buf.h"
+#include "kernel/iosched.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * C-LOOK elevator: the requests are kept sorted by block number and the
+ * head only moves upward. When there is no request above the head, it
+ * jumps back to the lowest request.
+ */
+
+static void clook_add(struct ioqueue *q, struct buf *buf) {
+    iosched_sorted_add(q, buf);
+}
+
+static struct buf *clook_dispatch(struct ioqueue *q) {
+    return iosched_sorted_next(q);
+}
+
+struct iosched clook_iosched = {
+    .name = "clook",
+    .add = clook_add,
+    .dispatch = clook_dispatch,
+};
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
@@ -0,0 +1,73 @@
+#include "kernel/buf.h"
+#include "kernel/iosched.h"
+#include "kernel/timer.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * Deadline: requests are served in C-LOOK order, unless the oldest request
+ * has waited longer than its deadline. Reads get a shorter deadline than
+ * writes because a task is usually blocked on them.
+ */
+
+#define READ_EXPIRE  100  // ticks
+#define WRITE_EXPIRE 1000 // ticks
+
+static void deadline_add(struct ioqueue *q, struct buf *buf) {
+    if (!iosched_sorted_add(q, buf)) {
+        return; // Merged.
+    }
+    if (q->fifo == NULL) {
+        q->fifo = buf;
+    } else {
+        q->fifo_tail->fnext = buf;
+    }
+    q->fifo_tail = buf;
+}
+
+static void fifo_remove(struct ioqueue *q, struct buf *rq) {
+    struct buf *prev = NULL;
+    for (struct buf *b = q->fifo; b != NULL; prev = b, b = b->fnext) {
+        if (b == rq) {
+            if (prev == NULL) {
+                q->fifo = b->fnext;
+            } else {
+                prev->fnext = b->fnext;
+            }
+            if (q->fifo_tail == rq) {
+                q->fifo_tail = prev;
+            }
+            return;
+        }
+    }
+}
+
+static struct buf *deadline_dispatch(struct ioqueue *q) {
+    struct buf *rq = q->fifo;
+    uint32_t expire = (rq->flags & BUF_FLAGS_DIRTY) ? WRITE_EXPIRE : READ_EXPIRE;
+
+    if (get_tick_count() - rq->io_tick >= expire) {
+        // The oldest request expired, serve it first.
+        iosched_sorted_remove(q, rq);
+    } else {
+        rq = iosched_sorted_next(q);
+    }
+    fifo_remove(q, rq);
+    return rq;
+}
+
+struct iosched deadline_iosched = {
+    .name = "deadline",
+    .add = deadline_add,
+    .dispatch = deadline_dispatch,
+};
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
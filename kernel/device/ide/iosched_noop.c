@@ -0,0 +1,46 @@
+#include "kernel/buf.h"
+#include "kernel/iosched.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * First come, first served. A buffer is only merged into the last request.
+ */
+
+static void noop_add(struct ioqueue *q, struct buf *buf) {
+    if (q->fifo_tail != NULL && iosched_try_merge(q, q->fifo_tail, buf)) {
+        return;
+    }
+    if (q->fifo == NULL) {
+        q->fifo = buf;
+    } else {
+        q->fifo_tail->fnext = buf;
+    }
+    q->fifo_tail = buf;
+    q->nr++;
+}
+
+static struct buf *noop_dispatch(struct ioqueue *q) {
+    struct buf *rq = q->fifo;
+    q->fifo = rq->fnext;
+    if (q->fifo == NULL) {
+        q->fifo_tail = NULL;
+    }
+    return rq;
+}
+
+struct iosched noop_iosched = {
+    .name = "noop",
+    .add = noop_add,
+    .dispatch = noop_dispatch,
+};
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
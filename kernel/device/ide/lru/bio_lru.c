@@ -0,0 +1,64 @@
+#include "../bio_policy.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+/**
+ * Least recently used. A released buffer goes to the head of the list and
+ * victims are taken from the tail.
+ */
+static struct buf lru_head;
+
+static void lru_init(uint32_t target_bufs) {
+    bufq_init(&lru_head);
+}
+
+static void lru_add(struct buf *buf) {
+    // Buffers without a block are recycled first.
+    bufq_push_tail(&lru_head, buf);
+}
+
+static void lru_del(struct buf *buf) {
+    bufq_remove(buf);
+}
+
+static void lru_hit(struct buf *buf) {
+}
+
+static void lru_release(struct buf *buf) {
+    bufq_remove(buf);
+    bufq_push_head(&lru_head, buf);
+}
+
+static bool lru_replace(struct buf *buf, struct disk *disk, uint32_t block_no) {
+    return false;
+}
+
+static struct buf *lru_first() {
+    return lru_head.prev == &lru_head ? NULL : lru_head.prev;
+}
+
+static struct buf *lru_next(struct buf *buf) {
+    return buf->prev == &lru_head ? NULL : buf->prev;
+}
+
+struct bio_policy bio_policy = {
+    .name = "LRU",
+    .init = lru_init,
+    .add = lru_add,
+    .del = lru_del,
+    .hit = lru_hit,
+    .release = lru_release,
+    .replace = lru_replace,
+    .first = lru_first,
+    .next = lru_next,
+};
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
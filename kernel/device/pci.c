@@ -0,0 +1,69 @@
+#include "kernel/pci.h"
+#include "kernel/x86.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_MAX_BUS  256
+#define PCI_MAX_DEV  32
+#define PCI_MAX_FUNC 8
+
+#define PCI_HEADER_TYPE    0x0C
+#define PCI_MULTI_FUNCTION 0x00800000
+
+static inline uint32_t pci_config_address(struct pci_dev *pdev, uint8_t offset) {
+    return 0x80000000 | (pdev->bus << 16) | (pdev->dev << 11) | (pdev->func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_read_config(struct pci_dev *pdev, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(pdev, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write_config(struct pci_dev *pdev, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(pdev, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+bool pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *pdev) {
+    for (uint32_t bus = 0; bus < PCI_MAX_BUS; bus++) {
+        for (uint32_t dev = 0; dev < PCI_MAX_DEV; dev++) {
+            for (uint32_t func = 0; func < PCI_MAX_FUNC; func++) {
+                pdev->bus = bus;
+                pdev->dev = dev;
+                pdev->func = func;
+
+                // No device(the vendor id reads as 0xFFFF).
+                if ((pci_read_config(pdev, 0) & 0xFFFF) == 0xFFFF) {
+                    if (func == 0) {
+                        break;
+                    }
+                    continue;
+                }
+
+                uint32_t class_rev = pci_read_config(pdev, PCI_CLASS_REV);
+                if ((class_rev >> 24) == class && ((class_rev >> 16) & 0xFF) == subclass) {
+                    return true;
+                }
+
+                // A single function device only answers as function 0.
+                if (func == 0 && (pci_read_config(pdev, PCI_HEADER_TYPE) & PCI_MULTI_FUNCTION) == 0) {
+                    break;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
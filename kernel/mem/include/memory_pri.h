@@ -25,6 +25,8 @@ typedef uint32_t pg_attr_t;
 extern pgdir_t kpgdir;
 
 // pmemory.c
+// Return the physical address of a free page, or NULL. The buffer cache is
+// shrunk when there is none.
 void *palloc();
 void pfree(void *page);
 
@@ -18,7 +18,8 @@ extern "C" {
 extern uint32_t get_total_memory();
 
 void *get_free_page() {
-    return KP2V(palloc());
+    void *paddr = palloc();
+    return paddr == NULL ? NULL : KP2V(paddr);
 }
 
 void free_page(void *pg_addr) {
@@ -1,3 +1,4 @@
+#include "kernel/buf.h"
 #include "kernel/debug.h"
 #include "kernel/memory.h"
 #include "string.h"
@@ -37,7 +38,10 @@ uint32_t get_using_page_cnt() {
     return r;
 }
 
-void *palloc() {
+/**
+ * Take a page from the free list, NULL if it is empty.
+ */
+static struct page *pmem_pop() {
     struct page *page = NULL;
     bool int_save;
     spinlock_acquire(&pmem.lock, &int_save);
@@ -48,7 +52,16 @@ void *palloc() {
         pmem.using_page_cnt++;
     }
     spinlock_release(&pmem.lock, &int_save);
-    return KV2P(page);
+    return page;
+}
+
+void *palloc() {
+    struct page *page = pmem_pop();
+    // Out of memory, take a page back from the buffer cache.
+    if (page == NULL && bio_shrink(1) > 0) {
+        page = pmem_pop();
+    }
+    return page == NULL ? NULL : KV2P(page);
 }
 
 void pfree(void *paddr) {
@@ -1,4 +1,5 @@
 #include "fs/inodes.h"
+#include "kernel/buf.h"
 #include "kernel/debug.h"
 #include "kernel/memory.h"
 #include "kernel/proc.h"
@@ -76,6 +77,12 @@ bool vm_valloc(struct vm *vm, uint32_t vaddr, uint32_t pgcnt) {
 
 bool vm_load(struct vm *vm, void *dst, struct inode *ip, uint32_t off, uint32_t sz) {
     struct vm *curvm = get_current_task()->vm;
+
+    // Program segments are read sequentially, start reading them all.
+    if (sz > 0) {
+        uint32_t bn = off / BLOCK_SIZE;
+        inode_readahead(ip, bn, ROUND_UP(off + sz, BLOCK_SIZE) - bn);
+    }
     if (curvm == vm) {
         return inode_read(ip, dst, off, sz) >= 0;
     }
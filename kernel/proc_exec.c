@@ -126,7 +126,7 @@ int proc_execv(char *path, char **argv) {
         return -1;
     }
 
-    log_begin_op(disk->log);
+    log_begin_op(disk->log, LOG_BUDGET_PUT);
     if ((ip = path_lookup(disk, path)) == NULL) {
         goto bad;
     }
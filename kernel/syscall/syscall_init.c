@@ -31,6 +31,7 @@ extern int sys_execv(struct trap_frame *tf);
 extern int sys_chdir(struct trap_frame *tf);
 extern int sys_pipe(struct trap_frame *tf);
 extern int sys_dup(struct trap_frame *tf);
+extern int sys_fsync(struct trap_frame *tf);
 
 static int (*syscalls[])(struct trap_frame *tf) = {
     [SYS_write] = sys_write,   [SYS_read] = sys_read,   [SYS_open] = sys_open,
@@ -38,7 +39,7 @@ static int (*syscalls[])(struct trap_frame *tf) = {
     [SYS_getpid] = sys_getpid, [SYS_yield] = sys_yield, [SYS_fork] = sys_fork,
     [SYS_sbrk] = sys_sbrk,     [SYS_stat] = sys_stat,   [SYS_execv] = sys_execv,
     [SYS_exit] = sys_exit,     [SYS_wait] = sys_wait,   [SYS_chdir] = sys_chdir,
-    [SYS_pipe] = sys_pipe,     [SYS_dup] = sys_dup,
+    [SYS_pipe] = sys_pipe,     [SYS_dup] = sys_dup,     [SYS_fsync] = sys_fsync,
 };
 
 static void syscall(struct trap_frame *tf) {
@@ -132,7 +132,7 @@ int sys_open(struct trap_frame *tf) {
     omode = SYS_ARG2(tf, uint32_t);
     disk = get_current_disk();
 
-    log_begin_op(disk->log);
+    log_begin_op(disk->log, (omode & O_CREAT) != 0 ? LOG_BUDGET_MAX : LOG_BUDGET_PUT);
 
     if ((omode & O_CREAT) != 0) {
         ip = create_file(path, INODE_FILE);
@@ -172,6 +172,7 @@ int sys_open(struct trap_frame *tf) {
 
     file->type = FD_INODE;
     file->offset = (omode & O_APPEND) == 0 ? 0 : ip->disk_inode.size;
+    file_ra_init(file);
     file->inode = ip;
     file->readable = (omode & O_WRONLY) == 0;
     file->writable = (omode & O_WRONLY) != 0 || (omode & O_RDWR) != 0;
@@ -203,6 +204,20 @@ int sys_dup(struct trap_frame *tf) {
     return 0;
 }
 
+/**
+ * Wait until the operations on the file system of @fd are committed to
+ * the log.
+ */
+int sys_fsync(struct trap_frame *tf) {
+    int fd = SYS_ARG1(tf, int);
+    struct file *f = fetch_file(fd);
+    if (f == NULL || f->type != FD_INODE) {
+        return -1;
+    }
+    log_force(f->inode->disk->log);
+    return 0;
+}
+
 int sys_mkdir(struct trap_frame *tf) {
     char *path = SYS_STRARG(1, tf);
     if (path == NULL) {
@@ -211,7 +226,7 @@ int sys_mkdir(struct trap_frame *tf) {
 
     struct inode *ip;
     struct log *log = get_current_disk()->log;
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
     if ((ip = create_file(path, INODE_DIRECTORY)) != NULL) {
         inode_put(ip);
         log_end_op(log);
@@ -233,7 +248,7 @@ int sys_unlink(struct trap_frame *tf) {
     struct inode *parent, *ip;
     uint32_t offset;
 
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
     if ((parent = path_lookup_parent(disk, path, name)) == NULL) {
         log_end_op(log);
         return -1;
@@ -356,7 +371,7 @@ int sys_chdir(struct trap_frame *tf) {
     struct inode *new_cwd;
     struct inode *prev_cwd;
 
-    log_begin_op(disk->log);
+    log_begin_op(disk->log, LOG_BUDGET_PUT);
 
     if ((new_cwd = path_lookup(disk, path)) == NULL) {
         log_end_op(disk->log);
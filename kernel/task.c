@@ -108,6 +108,7 @@ static void init_task_struct(struct task_struct *task, uint32_t priority, const
     task->killed = false;
     task->exit_status = 0;
     task->cwd = NULL;
+    task->log_budget = 0;
     task->parent = get_current_task();
     for (int i = 0; i < NOFILE; i++) {
         task->ofiles[i] = NULL;
@@ -212,7 +213,7 @@ void task_exit(int status) {
 
     if (task->cwd != NULL) {
         struct log *log = task->cwd->disk->log;
-        log_begin_op(log);
+        log_begin_op(log, LOG_BUDGET_PUT);
         inode_put(task->cwd);
         log_end_op(log);
         task->cwd = NULL;
@@ -26,6 +26,7 @@ int execv(const char *path, char **argv);
 int chdir(const char *path);
 int pipe(int *fds);
 int dup(int fd);
+int fsync(int fd);
 
 #ifdef __cplusplus
 }
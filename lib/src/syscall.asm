@@ -137,3 +137,11 @@ $pipe:
 	mov ebx, [esp + 4]
 	int 0x80
 	ret
+
+section .text
+global fsync
+$fsync: 
+	mov eax, 17
+	mov ebx, [esp + 4]
+	int 0x80
+	ret
@@ -68,16 +68,43 @@ void iwrite(struct disk *disk, struct inode *src, uint32_t inum) {
 	bwrite(disk, buf, bno);
 }
 
+void imap_init(struct disk *disk) {
+	struct superblock *sb = disk->sb;
+	char buf[BLOCK_SIZE];
+	memset(buf, 0, BLOCK_SIZE);
+	for (uint32_t i = 1; i < ROUND_UP(sb->ninodes, BITS_PER_BLOCK); i++) {
+		bwrite(disk, buf, sb->imap_start + i);
+	}
+	buf[0] = 1; // inum 0 is the NULL inode.
+	bwrite(disk, buf, sb->imap_start);
+	disk->icursor = 0;
+}
+
 uint32_t ialloc(struct disk *disk, enum inode_type type) {
 	struct superblock *sb = disk->sb;
+	uint32_t nimap = ROUND_UP(sb->ninodes, BITS_PER_BLOCK);
 	struct inode inode;
-	for (uint32_t inum = 1; inum < sb->ninodes; inum++) {
-		iread(disk, &inode, inum);
-		if (inode.type == INODE_NONE) {
-			memset(&inode, 0, sizeof(inode));
-			inode.type = type;
-			iwrite(disk, &inode, inum);
-			return inum;
+	char buf[BLOCK_SIZE];
+	for (uint32_t i = disk->icursor; i < nimap; i++) {
+		bread(disk, buf, sb->imap_start + i);
+		for (uint32_t bit = 0; bit < BITS_PER_BLOCK; bit++) {
+			uint32_t inum = i * BITS_PER_BLOCK + bit;
+			uint8_t m = 1 << (bit % 8);
+			if (inum >= sb->ninodes) {
+				break;
+			}
+			if ((buf[bit / 8] & m) == 0) {
+				buf[bit / 8] |= m;
+				bwrite(disk, buf, sb->imap_start + i);
+				disk->icursor = i;
+				memset(&inode, 0, sizeof(inode));
+				inode.type = type;
+				if ((sb->flags & SB_FLAGS_EXTENTS) && type != INODE_DEVICE) {
+					inode.flags = INODE_FLAGS_EXTENTS;
+				}
+				iwrite(disk, &inode, inum);
+				return inum;
+			}
 		}
 	}
 	fprintf(stderr, "no inodes.\n");
@@ -85,25 +112,99 @@ uint32_t ialloc(struct disk *disk, enum inode_type type) {
 	return 0;
 }
 
-static uint32_t bmap(struct disk *disk, struct inode *ip, uint32_t bn) {
+/**
+ * The block mapping of an extent-mapped inode. The blocks of a file are
+ * appended in order, so a missing block extends the last extent when it
+ * follows it on the disk.
+ */
+static uint32_t emap(struct disk *disk, struct inode *ip, uint32_t bn) {
 	char buf[BLOCK_SIZE];
+	struct extent *ext = ip->extents;
 	uint32_t addr;
+
+	if (ip->eblock != 0) {
+		bread(disk, buf, ip->eblock);
+		ext = (struct extent *) buf;
+	}
+	for (uint32_t i = 0; i < ip->nextents; i++) {
+		if (bn >= ext[i].lblock && bn - ext[i].lblock < ext[i].len) {
+			return ext[i].pblock + bn - ext[i].lblock;
+		}
+	}
+
+	addr = balloc(disk);
+	struct extent *last = ip->nextents > 0 ? &ext[ip->nextents - 1] : NULL;
+	if (last != NULL && bn == last->lblock + last->len && addr == last->pblock + last->len) {
+		last->len++;
+	} else {
+		if (ip->nextents == NBLOCK_EXTENTS) {
+			fprintf(stderr, "too many extents.\n");
+			exit(1);
+		}
+		// Move the extents of the inode to an extent block.
+		if (ip->nextents == NINODE_EXTENTS && ip->eblock == 0) {
+			ip->eblock = balloc(disk);
+			memset(buf, 0, BLOCK_SIZE);
+			memcpy(buf, ip->extents, sizeof ip->extents);
+			memset(ip->extents, 0, sizeof ip->extents);
+			ext = (struct extent *) buf;
+		}
+		ext[ip->nextents].lblock = bn;
+		ext[ip->nextents].pblock = addr;
+		ext[ip->nextents].len = 1;
+		ip->nextents++;
+	}
+	if (ip->eblock != 0) {
+		bwrite(disk, buf, ip->eblock);
+	}
+	return addr;
+}
+
+static uint32_t bmap(struct disk *disk, struct inode *ip, uint32_t bn) {
+	char buf[BLOCK_SIZE];
+	uint32_t addr, span;
 	uint32_t *indirect_addrs;
+	int level;
+	if (ip->flags & INODE_FLAGS_EXTENTS) {
+		return emap(disk, ip, bn);
+	}
 	if (bn < NDIRECT_DATA_BLOCKS) {
 		if ((addr = ip->addrs[bn]) == 0) {
 			ip->addrs[bn] = addr = balloc(disk);
 		}
 		return addr;
 	}
+
+	// Find the indirect tree of the block.
 	bn -= NDIRECT_DATA_BLOCKS;
-	if (ip->addrs[NDIRECT_DATA_BLOCKS] == 0) {
-		ip->addrs[NDIRECT_DATA_BLOCKS] = balloc(disk);
-	}
-	bread(disk, buf, ip->addrs[NDIRECT_DATA_BLOCKS]);
-	indirect_addrs = (uint32_t *) buf;
-	if ((addr = indirect_addrs[bn]) == 0) {
-		indirect_addrs[bn] = addr = balloc(disk);
-		bwrite(disk, buf, ip->addrs[NDIRECT_DATA_BLOCKS]);
+	level = 1;
+	span = NINDIRECT_DATA_BLOCKS;
+	while (bn >= span) {
+		bn -= span;
+		span *= NINDIRECT_DATA_BLOCKS;
+		level++;
+	}
+	if (level > NINDIRECT_LEVELS) {
+		fprintf(stderr, "file too large.\n");
+		exit(1);
+	}
+
+	int root = NDIRECT_DATA_BLOCKS + level - 1;
+	if (ip->addrs[root] == 0) {
+		ip->addrs[root] = balloc(disk);
+	}
+	addr = ip->addrs[root];
+	for (; level > 0; level--) {
+		span /= NINDIRECT_DATA_BLOCKS;
+		uint32_t i = bn / span;
+		bn %= span;
+		bread(disk, buf, addr);
+		indirect_addrs = (uint32_t *) buf;
+		if (indirect_addrs[i] == 0) {
+			indirect_addrs[i] = balloc(disk);
+			bwrite(disk, buf, addr);
+		}
+		addr = indirect_addrs[i];
 	}
 	return addr;
 }
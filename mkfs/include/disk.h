@@ -11,6 +11,7 @@ struct disk {
 	FILE *fp;
 	struct superblock *sb;
 	int sector_cnt;
+	uint32_t icursor; // Inode bitmap block where ialloc() starts.
 };
 
 static inline void read_sector(FILE *fp, int lba, char *buf, int sector_cnt) {
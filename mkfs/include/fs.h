@@ -20,18 +20,49 @@ enum inode_type {
 	INODE_DEVICE = 3,
 };
 
+#define INODE_FLAGS_EXTENTS 0x1 // The blocks are mapped by extents.
+#define INODE_FLAGS_EINDEX  0x2 // The extent block is an index of extent blocks.
+
+// A run of blocks, see include/fs/inodes.h.
+struct extent {
+	uint32_t lblock;
+	uint32_t pblock;
+	uint32_t len;
+} __attribute__((packed));
+
+#define NINODE_EXTENTS 4
+#define NBLOCK_EXTENTS (BLOCK_SIZE / sizeof(struct extent))
+
 struct inode {
 	uint32_t type;      // File type.
 	uint32_t nlink;		  // Number of links to this inode in file system.
 	uint32_t size;      // Size of file (bytes)
 	int32_t major;      // Major number of device(INODE_DEVICE only)
 	int32_t minor;      // Minor number of device(INODE_DEVICE only)
-	
-	uint32_t addrs[NDIRECT_DATA_BLOCKS + 1];
+	uint32_t flags;     // INODE_FLAGS_*.
+
+	union {
+		uint32_t addrs[NDIRECT_DATA_BLOCKS + NINDIRECT_LEVELS];
+		struct {
+			uint32_t nextents;
+			uint32_t eblock;
+			struct extent extents[NINODE_EXTENTS];
+		};
+	};
 } __attribute__((packed));
 
 
+#define LOG_MAGIC 0x4C4F4753
+
+// The first block of the log, see include/fs/log.h.
+struct log_super {
+	uint32_t magic;
+	uint32_t tail;
+	uint32_t seq;
+};
+
 uint32_t balloc(struct disk *);
+void imap_init(struct disk *);
 uint32_t ialloc(struct disk *, enum inode_type type);
 void iread(struct disk *, struct inode *inode, uint32_t inum);
 void iwrite(struct disk *, struct inode *inode, uint32_t inum);
@@ -41,6 +72,9 @@ void dir_make(struct disk *, uint32_t parentinum, uint32_t dirinum);
 uint32_t create_file(struct disk *, int32_t major, int32_t minor,
 					 enum inode_type type, uint32_t pinum, char *name);
 
+// Print the fragmentation of the files and of the free space.
+void fs_report(struct disk *);
+
 #define fs_mkdir(disk, pinum, name)                                            \
 	create_file(disk, 0, 0, INODE_DIRECTORY, pinum, name)
 
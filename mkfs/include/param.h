@@ -1,10 +1,18 @@
+#include <stdint.h>
+
 #define NDIRECT_DATA_BLOCKS 11
+#define NINDIRECT_LEVELS 3 // Single, double and triple indirect blocks.
 #define NFILES_PER_DISK (4096 * 4) // Number of files per disk.
 
 #define MAX_OPEN_BLOCKS 10
-#define LOG_SIZE (MAX_OPEN_BLOCKS * 3)
+#define LOG_SIZE_KB 1024                      // Default size of the log.
+#define LOG_MIN_BLOCKS (MAX_OPEN_BLOCKS * 3 + 1) // The log super block and the area.
 
-#define BLOCK_SIZE 512
+// The block size is chosen by -b, 512 to 4096 bytes, see mkfs.c.
+extern uint32_t block_size;
+#define BLOCK_SIZE block_size
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 4096
 #define SECTOR_SIZE 512
 #define LBA_TO_BLOCK_NO(lba) ((lba) / (BLOCK_SIZE / SECTOR_SIZE))
 
@@ -12,7 +20,10 @@
 #define NINDIRECT_DATA_BLOCKS (BLOCK_SIZE / sizeof(uint32_t))
 
 // Maximum number of data blocks of a inode.
-#define MAX_DATA_BLOCKS (NDIRECT_DATA_BLOCKS + NINDIRECT_DATA_BLOCKS)
+#define MAX_DATA_BLOCKS                                                        \
+	(NDIRECT_DATA_BLOCKS + NINDIRECT_DATA_BLOCKS +                             \
+	 NINDIRECT_DATA_BLOCKS * NINDIRECT_DATA_BLOCKS +                           \
+	 NINDIRECT_DATA_BLOCKS * NINDIRECT_DATA_BLOCKS * NINDIRECT_DATA_BLOCKS)
 
 // Number of inodes per block
 #define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(struct inode))
@@ -6,7 +6,11 @@
 
 #define ROUND_UP(X, STEP) (((X) + (STEP) - 1) / (STEP))
 
-#define SUPER_BLOCK_MAGIC 0xF2E3EACF
+#define SUPER_BLOCK_MAGIC 0xF2E3EAD0
+#define SUPER_BLOCK_MAGIC_OLD 0xF2E3EACF // The format before the imap, the inode flags and the block size.
+
+#define SB_FLAGS_ORDERED 0x1 // Ordered-data journaling.
+#define SB_FLAGS_EXTENTS 0x2 // Inodes are mapped by extents.
 
 struct disk;
 struct superblock {
@@ -20,8 +24,11 @@ struct superblock {
 	uint32_t bmap_start;   // Block number of the first free bitmap block.
 	uint32_t bmap_bytes;   // Number of bmap bytes.
 	uint32_t bdata_start;  // Block number of the first data block.
+	uint32_t flags;        // SB_FLAGS_*.
+	uint32_t imap_start;   // Block number of the first inode bitmap block.
+	uint32_t block_size;   // Bytes per block.
 };
 
-void superblock_init(struct disk*, struct superblock *);
+void superblock_init(struct disk*, struct superblock *, uint32_t nlog, uint32_t flags);
 
 #endif /* _SUPERBLOCK_H */
@@ -10,9 +10,15 @@
 #include "fs.h"
 #include "superblock.h"
 
+uint32_t block_size = MIN_BLOCK_SIZE;
+
 struct mkfs_flags {
 	char *img_file;
 	char *initsh_file;
+	uint32_t log_kb;
+	uint32_t log_blocks;
+	uint32_t sb_flags;
+	bool report;
 	char **binfiles;
 	size_t binfiles_len;
 };
@@ -28,7 +34,8 @@ static void usage(int code);
 static void parse_flags(int argc, char **argv, struct mkfs_flags *flags);
 
 static char *nameptr(char *path);
-static bool createfs(struct disk *);
+static bool createfs(struct disk *, struct mkfs_flags *flags);
+static void reportfs(struct disk *);
 static uint32_t create_root_file(struct disk *);
 static void create_initial_files(struct disk *, struct mkfs_flags *flags);
 
@@ -51,7 +58,9 @@ int main(int argc, char **argv) {
 	disk.fp = hdimgfp;
 	disk.sector_cnt = file_size / 512;
 
-	if (createfs(&disk)) {
+	if (flags.report) {
+		reportfs(&disk);
+	} else if (createfs(&disk, &flags)) {
 		create_initial_files(&disk, &flags);
 	}
 	return 0;
@@ -76,6 +85,12 @@ static void usage(int code) {
 				 "Options: \n"
 				 "  -h --help                 print usage.\n"
 				 "  -i --imgfile <arg>        make a file system in the specified image file.\n"
+				 "  -b --block-size <bytes>   block size, 512(default), 1024, 2048 or 4096.\n"
+				 "  -l --log-size <KB>        size of the log, 1024 KB by default.\n"
+				 "  --data <mode>             journaling of file data: ordered(default) or journal.\n"
+				 "  --extents                 map the blocks of the inodes by extents.\n"
+				 "  -r --report               print the fragmentation of the file system in the\n"
+				 "                            image file instead of making one.\n"
 				 "  --ish                     specify the ‘/etc/init.sh‘ file.\n");
 	exit(code);
 }
@@ -91,6 +106,9 @@ static void parse_flags(int argc, char **argv, struct mkfs_flags *flags) {
 	flags->binfiles_len = 0;
 	flags->binfiles = NULL;
 	flags->initsh_file = NULL;
+	flags->log_kb = LOG_SIZE_KB;
+	flags->sb_flags = SB_FLAGS_ORDERED;
+	flags->report = false;
 
 	for (int i = 1; i < argc; i++) {
 		char *arg = argv[i];
@@ -103,6 +121,43 @@ static void parse_flags(int argc, char **argv, struct mkfs_flags *flags) {
 				error(1, "-i, --imgfile: missing the image file.")
 			}
 			flags->img_file = argv[++i];
+		} else if (!strcmp(arg, "-l") || !strcmp(arg, "--log-size")) {
+			if (i == maxi) {
+				error(1, "-l, --log-size: missing the size.")
+			}
+			char *end;
+			unsigned long kb = strtoul(argv[++i], &end, 10);
+			if (*end != '\0' || kb == 0) {
+				error(1, "-l, --log-size: invalid size: %s.", argv[i])
+			}
+			flags->log_kb = kb;
+		} else if (!strcmp(arg, "-b") || !strcmp(arg, "--block-size")) {
+			if (i == maxi) {
+				error(1, "-b, --block-size: missing the size.")
+			}
+			char *end;
+			unsigned long size = strtoul(argv[++i], &end, 10);
+			if (*end != '\0' || size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE ||
+				(size & (size - 1)) != 0) {
+				error(1, "-b, --block-size: invalid size: %s.", argv[i])
+			}
+			block_size = size;
+		} else if (!strcmp(arg, "--data")) {
+			if (i == maxi) {
+				error(1, "--data: missing the mode.")
+			}
+			char *mode = argv[++i];
+			if (!strcmp(mode, "ordered")) {
+				flags->sb_flags |= SB_FLAGS_ORDERED;
+			} else if (!strcmp(mode, "journal")) {
+				flags->sb_flags &= ~SB_FLAGS_ORDERED;
+			} else {
+				error(1, "--data: invalid mode: %s.", mode)
+			}
+		} else if (!strcmp(arg, "--extents")) {
+			flags->sb_flags |= SB_FLAGS_EXTENTS;
+		} else if (!strcmp(arg, "-r") || !strcmp(arg, "--report")) {
+			flags->report = true;
 		} else if (!strcmp(arg, "--ish")) {
 			if (i == maxi) {
 				error(1, "--ish: missing the script file.")
@@ -118,6 +173,12 @@ static void parse_flags(int argc, char **argv, struct mkfs_flags *flags) {
 	if (flags->img_file == NULL) {
 		error(1, "missing the image file.");
 	}
+
+	flags->log_blocks = flags->log_kb * 1024 / BLOCK_SIZE;
+	if (flags->log_blocks < LOG_MIN_BLOCKS) {
+		error(1, "-l, --log-size: %d KB at least with %d-byte blocks.",
+			  LOG_MIN_BLOCKS * BLOCK_SIZE / 1024 + 1, BLOCK_SIZE)
+	}
 }
 
 static char *nameptr(char *path) {
@@ -131,7 +192,7 @@ static char *nameptr(char *path) {
 	return name;
 }
 
-static bool createfs(struct disk *disk) {
+static bool createfs(struct disk *disk, struct mkfs_flags *flags) {
 	char buf[512];
 	struct superblock *sb = (struct superblock *) buf;
 	// Read one sector(512 bytes) to the buffer at the lba 1.
@@ -140,14 +201,45 @@ static bool createfs(struct disk *disk) {
 		printf("found fs.\n");
 		return false;
 	}
-	superblock_init(disk, sb);
+	if (sb->magic == SUPER_BLOCK_MAGIC_OLD) {
+		printf("found fs of an old format, making it again.\n");
+	}
+	superblock_init(disk, sb, flags->log_blocks, flags->sb_flags);
 	// Write the buffer(superblock) to the image file.
 	write_sector(disk->fp, 1, buf, 1);
 	disk->sb = ckmalloc(sizeof(struct superblock));
 	memcpy(disk->sb, sb, sizeof(struct superblock));
+	imap_init(disk);
+
+	// An empty log.
+	struct log_super *log = (struct log_super *) buf;
+	memset(buf, 0, sizeof(buf));
+	log->magic = LOG_MAGIC;
+	log->tail = 0;
+	log->seq = 1;
+	write_sector(disk->fp, disk->sb->log_start * (BLOCK_SIZE / SECTOR_SIZE), buf, 1);
 	return true;
 }
 
+static void reportfs(struct disk *disk) {
+	char buf[512];
+	struct superblock *sb = (struct superblock *) buf;
+	read_sector(disk->fp, 1, buf, 1);
+	if (sb->magic == SUPER_BLOCK_MAGIC_OLD) {
+		error(1, "file system of an old format in the image file, make it again.")
+	}
+	if (sb->magic != SUPER_BLOCK_MAGIC) {
+		error(1, "no file system in the image file.")
+	}
+	block_size = sb->block_size;
+	if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) {
+		error(1, "invalid block size: %d.", block_size)
+	}
+	disk->sb = ckmalloc(sizeof(struct superblock));
+	memcpy(disk->sb, sb, sizeof(struct superblock));
+	fs_report(disk);
+}
+
 /**
  * Write the file from the current OS to the file system in the disk.
  *
@@ -0,0 +1,184 @@
+#include "disk.h"
+#include "fs.h"
+#include "superblock.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * The fragmentation report of an existing file system.
+ *
+ * A fragment is a run of blocks of a file which are contiguous on the disk,
+ * so a file of n fragments needs n - 1 seeks to be read sequentially.
+ */
+
+struct frag_stats {
+	uint32_t files;      // Files with at least one block.
+	uint32_t fragmented; // Files with more than one fragment.
+	uint32_t blocks;     // Data blocks of the files.
+	uint32_t frags;      // Fragments of the files.
+};
+
+static void read_block(struct disk *disk, char *buf, uint32_t bno) {
+	read_sector(disk->fp, bno * (BLOCK_SIZE / SECTOR_SIZE), buf, BLOCK_SIZE / SECTOR_SIZE);
+}
+
+/**
+ * Add the data blocks of the tree of the indirect block @addr to the
+ * fragments of a file, @level - 1 levels above the data blocks. The
+ * indirect blocks are not counted as data blocks.
+ */
+static void report_tree(struct disk *disk, uint32_t addr, int level, uint32_t *nblocks,
+						uint32_t *prev, uint32_t *blocks, uint32_t *frags) {
+	uint32_t addrs[NINDIRECT_DATA_BLOCKS];
+
+	read_block(disk, (char *) addrs, addr);
+	for (uint32_t i = 0; i < NINDIRECT_DATA_BLOCKS && *nblocks > 0; i++) {
+		if (level > 1) {
+			if (addrs[i] != 0) {
+				report_tree(disk, addrs[i], level - 1, nblocks, prev, blocks, frags);
+			}
+			continue;
+		}
+		(*nblocks)--;
+		if (addrs[i] == 0) {
+			continue;
+		}
+		if (*prev == 0 || addrs[i] != *prev + 1) {
+			(*frags)++;
+		}
+		(*blocks)++;
+		*prev = addrs[i];
+	}
+}
+
+/**
+ * Add the @n extents @ext to the fragments.
+ */
+static void report_leaf(struct extent *ext, uint32_t n, uint32_t *prev, uint32_t *blocks,
+						uint32_t *frags) {
+	for (uint32_t i = 0; i < n && i < NBLOCK_EXTENTS; i++) {
+		if (*prev == 0 || ext[i].pblock != *prev + 1) {
+			(*frags)++;
+		}
+		*blocks += ext[i].len;
+		*prev = ext[i].pblock + ext[i].len - 1;
+	}
+}
+
+/**
+ * Add the extents of an extent-mapped inode to the fragments.
+ */
+static void report_extents(struct disk *disk, struct inode *ip, uint32_t *prev, uint32_t *blocks,
+						   uint32_t *frags) {
+	char buf[BLOCK_SIZE], leaf[BLOCK_SIZE];
+
+	if (ip->eblock == 0) {
+		report_leaf(ip->extents, ip->nextents, prev, blocks, frags);
+		return;
+	}
+	read_block(disk, buf, ip->eblock);
+	if ((ip->flags & INODE_FLAGS_EINDEX) == 0) {
+		report_leaf((struct extent *) buf, ip->nextents, prev, blocks, frags);
+		return;
+	}
+	// The entries of the index are extent blocks and their number of extents.
+	struct extent *idx = (struct extent *) buf;
+	for (uint32_t i = 0; i < ip->nextents && i < NBLOCK_EXTENTS; i++) {
+		read_block(disk, leaf, idx[i].pblock);
+		report_leaf((struct extent *) leaf, idx[i].len, prev, blocks, frags);
+	}
+}
+
+/**
+ * Count the fragments of the inode.
+ */
+static void report_inode(struct disk *disk, struct inode *ip, struct frag_stats *st) {
+	uint32_t nblocks = ROUND_UP(ip->size, BLOCK_SIZE);
+	uint32_t prev = 0;
+	uint32_t blocks = 0, frags = 0;
+
+	if (ip->flags & INODE_FLAGS_EXTENTS) {
+		report_extents(disk, ip, &prev, &blocks, &frags);
+		nblocks = 0;
+	}
+	for (uint32_t bn = 0; bn < NDIRECT_DATA_BLOCKS && nblocks > 0; bn++, nblocks--) {
+		uint32_t addr = ip->addrs[bn];
+		if (addr == 0) {
+			continue;
+		}
+		if (prev == 0 || addr != prev + 1) {
+			frags++;
+		}
+		blocks++;
+		prev = addr;
+	}
+	for (int level = 1; level <= NINDIRECT_LEVELS && nblocks > 0; level++) {
+		uint32_t root = ip->addrs[NDIRECT_DATA_BLOCKS + level - 1];
+		if (root != 0) {
+			report_tree(disk, root, level, &nblocks, &prev, &blocks, &frags);
+		}
+	}
+
+	if (blocks == 0) {
+		return;
+	}
+	st->files++;
+	st->blocks += blocks;
+	st->frags += frags;
+	if (frags > 1) {
+		st->fragmented++;
+	}
+}
+
+/**
+ * Print the runs of free blocks of the bitmap.
+ */
+static void report_free(struct disk *disk) {
+	struct superblock *sb = disk->sb;
+	char buf[BLOCK_SIZE];
+	uint32_t nbits = sb->bmap_bytes * 8;
+	uint32_t nfree = 0, runs = 0, run = 0, largest = 0;
+
+	for (uint32_t b = 0; b < nbits; b++) {
+		if (b % BITS_PER_BLOCK == 0) {
+			read_block(disk, buf, sb->bmap_start + b / BITS_PER_BLOCK);
+		}
+		uint32_t bit = b % BITS_PER_BLOCK;
+		if ((buf[bit / 8] & (1 << (bit % 8))) == 0) {
+			if (run++ == 0) {
+				runs++;
+			}
+			nfree++;
+			if (run > largest) {
+				largest = run;
+			}
+		} else {
+			run = 0;
+		}
+	}
+
+	printf("free blocks:        %u in %u runs, largest run %u blocks\n", nfree, runs, largest);
+}
+
+void fs_report(struct disk *disk) {
+	struct superblock *sb = disk->sb;
+	struct frag_stats st;
+	struct inode inode;
+
+	memset(&st, 0, sizeof(st));
+	for (uint32_t inum = 1; inum < sb->ninodes; inum++) {
+		iread(disk, &inode, inum);
+		if (inode.type == INODE_FILE || inode.type == INODE_DIRECTORY) {
+			report_inode(disk, &inode, &st);
+		}
+	}
+
+	printf("files:              %u, %u blocks\n", st.files, st.blocks);
+	if (st.files != 0) {
+		printf("fragments:          %u, %u.%02u blocks/fragment\n", st.frags,
+			   st.blocks / st.frags, st.blocks * 100 / st.frags % 100);
+		printf("fragmented files:   %u (%u%%)\n", st.fragmented, st.fragmented * 100 / st.files);
+	}
+	report_free(disk);
+}
@@ -3,23 +3,30 @@
 #include "superblock.h"
 #include <stdlib.h>
 
-void superblock_init(struct disk *disk, struct superblock *sb) {
+void superblock_init(struct disk *disk, struct superblock *sb, uint32_t nlog, uint32_t flags) {
 	
-	uint32_t inode_blocks, bmap_blocks, data_blocks;
+	uint32_t inode_blocks, imap_blocks, bmap_blocks, data_blocks;
 	uint32_t bmap_bytes;
 		
 	sb->magic = SUPER_BLOCK_MAGIC;
+	sb->flags = flags;
+	sb->block_size = BLOCK_SIZE;
 	sb->size = LBA_TO_BLOCK_NO(disk->sector_cnt);
 	
-	// Skip boot sector and superblock sector.
-	sb->inode_start = LBA_TO_BLOCK_NO(2);
+	// Skip boot sector and superblock sector, which share the first block
+	// if the block is larger than 1 KB.
+	sb->inode_start = ROUND_UP(2 * SECTOR_SIZE, BLOCK_SIZE);
 	sb->ninodes = NFILES_PER_DISK;
 	inode_blocks = ROUND_UP(NFILES_PER_DISK, INODES_PER_BLOCK);
+
+	// One bit per inode.
+	sb->imap_start = sb->inode_start + inode_blocks + 1;
+	imap_blocks = ROUND_UP(NFILES_PER_DISK, BITS_PER_BLOCK);
 	
-	sb->log_start = sb->inode_start + inode_blocks + 1;
-	sb->nlog = LOG_SIZE + 1; // log header and log blocks.
+	sb->log_start = sb->imap_start + imap_blocks;
+	sb->nlog = nlog; // log super block and the circular area.
 
-	data_blocks = sb->size - inode_blocks - sb->nlog - LBA_TO_BLOCK_NO(2) - 1;
+	data_blocks = sb->size - inode_blocks - imap_blocks - sb->nlog - sb->inode_start - 1;
 	if (data_blocks > sb->size) { // overflow
 		goto bad;
 	}
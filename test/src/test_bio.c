@@ -0,0 +1,368 @@
+#include "os_test_asserts.h"
+#include "os_test_runner.h"
+
+#include "fs/superblock.h"
+#include "kernel/buf.h"
+#include "kernel/ide.h"
+#include "kernel/iosched.h"
+#include "kernel/memory.h"
+#include "kernel/timer.h"
+
+#include "string.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#endif /* __cplusplus */
+
+static void buf_hit_test();
+static void buf_lookup_cost_test();
+static void buf_shrink_test();
+static void buf_readahead_test();
+static void buf_async_test();
+static void iosched_merge_test();
+static void ide_stats_test();
+static void buf_writeback_test();
+static void buf_scan_test();
+
+void bio_test() {
+    test_task_t tasks[] = {
+        CREATE_TEST_TASK(buf_hit_test),
+        CREATE_TEST_TASK(buf_lookup_cost_test),
+        CREATE_TEST_TASK(buf_shrink_test),
+        CREATE_TEST_TASK(buf_readahead_test),
+        CREATE_TEST_TASK(buf_async_test),
+        CREATE_TEST_TASK(iosched_merge_test),
+        CREATE_TEST_TASK(ide_stats_test),
+        CREATE_TEST_TASK(buf_writeback_test),
+        CREATE_TEST_TASK(buf_scan_test),
+    };
+
+    os_test_run(tasks, sizeof(tasks) / sizeof(test_task_t));
+}
+
+static void buf_hit_test() {
+    struct disk *disk = get_current_disk();
+    uint32_t block_no = disk->sb->bdata_start;
+    struct bio_stats before, after;
+    struct buf *b1, *b2;
+
+    b1 = buf_read(disk, block_no);
+    assert_true((b1->flags & BUF_FLAGS_VALID) != 0);
+    buf_release(b1);
+
+    bio_get_stats(&before);
+    b2 = buf_read(disk, block_no);
+    bio_get_stats(&after);
+
+    // The second read must be served from the cache by the same buffer.
+    assert_ptr_equal(b1, b2);
+    assert_int_equal(before.hits + 1, after.hits);
+    assert_int_equal(before.misses, after.misses);
+    buf_release(b2);
+}
+
+/**
+ * Fill the cache with a growing number of blocks and measure the cost
+ * of looking them up again.
+ */
+static void buf_lookup_cost_test() {
+#define ROUNDS 200
+    const uint32_t sizes[] = {5, 10, 20, 40, 160, 640};
+
+    struct disk *disk = get_current_disk();
+    uint32_t base = disk->sb->bdata_start;
+    struct bio_stats before, after;
+    struct buf *buf;
+
+    for (uint32_t i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+        uint32_t n = sizes[i];
+
+        // Make all the blocks present in the cache.
+        for (uint32_t bn = 0; bn < n; bn++) {
+            buf_release(buf_read(disk, base + bn));
+        }
+
+        bio_get_stats(&before);
+        unsigned long ticks = get_tick_count();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (uint32_t bn = 0; bn < n; bn++) {
+                buf = buf_read(disk, base + bn);
+                buf_release(buf);
+            }
+        }
+        ticks = get_tick_count() - ticks;
+        bio_get_stats(&after);
+
+        uint32_t lookups = after.lookups - before.lookups;
+        uint32_t probes = after.probes - before.probes;
+        assert_int_equal(ROUNDS * n, lookups);
+        assert_int_equal(lookups, after.hits - before.hits);
+
+        os_test_printf("%d cached blocks: %d lookups, %d ticks, %d.%d probes/lookup\n", n,
+                       lookups, ticks, probes / lookups, (probes * 10 / lookups) % 10);
+
+        // A hash lookup must not degrade into a scan of the whole cache.
+        assert_true(probes / lookups <= 3);
+    }
+#undef ROUNDS
+}
+
+static void buf_shrink_test() {
+    extern void *palloc();
+    extern void pfree(void *page);
+
+    struct disk *disk = get_current_disk();
+    uint32_t base = disk->sb->bdata_start + 4096;
+
+    // Grow the cache past the buffers allocated at boot time.
+    for (uint32_t bn = 0; bn < 256; bn++) {
+        buf_release(buf_read(disk, base + bn));
+    }
+    uint32_t nbufs = bio_get_nbufs();
+    uint32_t free_pages = get_free_page_cnt();
+    assert_true(nbufs >= 256);
+
+    uint32_t freed = bio_shrink(4);
+    assert_true(freed > 0 && freed <= 4);
+    assert_int_equal(free_pages + freed, get_free_page_cnt());
+    assert_int_equal(nbufs - freed * (PG_SIZE / BLOCK_SIZE), bio_get_nbufs());
+
+    // The cache grows again on misses.
+    for (uint32_t bn = 0; bn < nbufs; bn++) {
+        buf_release(buf_read(disk, base + bn));
+    }
+    assert_true(bio_get_nbufs() >= nbufs);
+
+    // The page allocator takes pages back from the cache once it runs out
+    // of free pages. The pages taken are linked through their first word.
+    void *pages = NULL, *page;
+    while (get_free_page_cnt() > 0 && (page = palloc()) != NULL) {
+        *(void **) KP2V(page) = pages;
+        pages = page;
+    }
+    nbufs = bio_get_nbufs();
+    page = palloc();
+    assert_true(page != NULL);
+    assert_int_equal(nbufs - PG_SIZE / BLOCK_SIZE, bio_get_nbufs());
+    *(void **) KP2V(page) = pages;
+    pages = page;
+
+    while (pages != NULL) {
+        page = *(void **) KP2V(pages);
+        pfree(pages);
+        pages = page;
+    }
+}
+
+static void buf_readahead_test() {
+#define NBLOCKS 8
+    struct disk *disk = get_current_disk();
+    uint32_t base = disk->sb->bdata_start + 8192;
+    struct bio_stats before, after;
+    struct buf *buf;
+
+    bio_get_stats(&before);
+    for (uint32_t bn = 0; bn < NBLOCKS; bn++) {
+        buf_readahead(disk, base + bn);
+    }
+    // Already in the cache (or in flight), nothing is issued twice.
+    buf_readahead(disk, base);
+    bio_get_stats(&after);
+    assert_int_equal(before.ra_issued + NBLOCKS, after.ra_issued);
+
+    for (uint32_t bn = 0; bn < NBLOCKS; bn++) {
+        buf = buf_read(disk, base + bn);
+        assert_true((buf->flags & BUF_FLAGS_VALID) != 0);
+        assert_int_equal(0, buf->flags & BUF_FLAGS_READAHEAD);
+        buf_release(buf);
+    }
+    bio_get_stats(&after);
+    assert_int_equal(before.ra_hits + NBLOCKS, after.ra_hits);
+#undef NBLOCKS
+}
+
+static void count_end_io(struct buf *buf, void *arg) {
+    (*(int *) arg)++;
+}
+
+static void buf_async_test() {
+#define NBLOCKS 8
+    struct disk *disk = get_current_disk();
+    uint32_t base = disk->sb->bdata_start + 8192;
+    struct buf *bufs[NBLOCKS];
+    int done = 0;
+
+    // Write the blocks back unchanged with all requests in flight at once.
+    for (uint32_t bn = 0; bn < NBLOCKS; bn++) {
+        bufs[bn] = buf_read(disk, base + bn);
+        buf_write_async(bufs[bn], count_end_io, &done);
+    }
+    for (uint32_t bn = 0; bn < NBLOCKS; bn++) {
+        assert_int_equal(0, buf_wait(bufs[bn]));
+        assert_true(buf_poll(bufs[bn]));
+        assert_int_equal(BUF_FLAGS_VALID, bufs[bn]->flags & (BUF_FLAGS_VALID | BUF_FLAGS_DIRTY |
+                                                             BUF_FLAGS_ERROR));
+        buf_release(bufs[bn]);
+    }
+    assert_int_equal(NBLOCKS, done);
+#undef NBLOCKS
+}
+
+static void iosched_merge_test() {
+#define NBLOCKS 16
+    struct iosched *sched = iosched_get_current();
+    struct disk *disk = get_current_disk();
+    uint32_t base = disk->sb->bdata_start + 8192;
+    struct iosched_stats before, after;
+    struct ide_stats ide_before, ide_after;
+    struct buf *bufs[NBLOCKS];
+    bool int_save;
+
+    for (uint32_t bn = 0; bn < NBLOCKS; bn++) {
+        bufs[bn] = buf_read(disk, base + bn);
+    }
+
+    // Queue contiguous writes at once, the ones behind the first are merged.
+    // The first one is not finished before the others are queued, since the
+    // interrupts are disabled meanwhile.
+    iosched_get_stats(sched, &before);
+    ide_get_stats(disk->ide_chan, &ide_before);
+    INT_LOCK(int_save);
+    for (uint32_t bn = 0; bn < NBLOCKS; bn++) {
+        buf_write_async(bufs[bn], NULL, NULL);
+    }
+    INT_UNLOCK(int_save);
+    for (uint32_t bn = 0; bn < NBLOCKS; bn++) {
+        buf_wait(bufs[bn]);
+        buf_release(bufs[bn]);
+    }
+    iosched_get_stats(sched, &after);
+    ide_get_stats(disk->ide_chan, &ide_after);
+
+    uint32_t merges = after.merges - before.merges;
+    uint32_t dispatches = after.dispatches - before.dispatches;
+    uint32_t irqs = ide_after.irqs - ide_before.irqs;
+    os_test_printf("%s: %d writes, %d requests, %d merged, %d irqs, max latency %d ticks\n",
+                   sched->name, NBLOCKS, dispatches, merges, irqs, after.max_latency);
+
+    assert_int_equal(before.requests + NBLOCKS, after.requests);
+    assert_int_equal(before.write_blocks + NBLOCKS, after.write_blocks);
+    assert_int_equal(NBLOCKS, dispatches + merges);
+    assert_true(merges > 0);
+    assert_true(dispatches < NBLOCKS);
+
+    // A merged request is one transfer: with multiple sectors per interrupt
+    // or DMA, it takes fewer interrupts than sectors.
+    if (disk->mult_secs != 0 || disk->ide_chan->bmide_base != 0) {
+        assert_true(irqs < NBLOCKS * (BLOCK_SIZE / SECTOR_SIZE));
+    }
+#undef NBLOCKS
+}
+
+static void ide_stats_test() {
+    struct disk *disk = get_current_disk();
+    struct ide_stats stats;
+
+    ide_get_stats(disk->ide_chan, &stats);
+    os_test_printf("%s: %d irqs, %d spurious, %d errors, %d timeouts, %d polls, %dK cycles polling\n",
+                   disk->ide_chan->name, stats.irqs, stats.spurious, stats.errors, stats.timeouts,
+                   stats.polls, (uint32_t)(stats.poll_cycles >> 10));
+
+    assert_true(stats.irqs > 0);
+    assert_int_equal(0, stats.errors);
+    assert_int_equal(0, stats.timeouts);
+}
+
+static void buf_writeback_test() {
+    struct disk *disk = get_current_disk();
+    uint32_t block_no = disk->sb->bdata_start + 8192;
+    struct bio_stats before, after;
+    struct buf *buf;
+
+    bio_get_stats(&before);
+    for (int i = 0; i < 3; i++) {
+        buf = buf_read(disk, block_no);
+        buf_write_delayed(buf);
+        assert_true((buf->flags & BUF_FLAGS_DELWRI) != 0);
+        buf_release(buf);
+    }
+    assert_true(disk->nr_delwri > 0);
+
+    // The block is written once for the three writes.
+    bio_sync(disk);
+    bio_get_stats(&after);
+    assert_int_equal(before.delwri + 1, after.delwri);
+    assert_int_equal(before.absorbed + 2, after.absorbed);
+    assert_true(after.written > before.written);
+    assert_int_equal(0, disk->nr_delwri);
+
+    buf = buf_read(disk, block_no);
+    assert_int_equal(BUF_FLAGS_VALID, buf->flags & (BUF_FLAGS_VALID | BUF_FLAGS_DELWRI));
+    buf_release(buf);
+}
+
+/**
+ * Read the blocks from @block_no on once, until the cache has evicted
+ * twice its size. The @nhot blocks from @hot are read again after every
+ * few blocks. Return the block following the last one read.
+ */
+static uint32_t scan_cache(struct disk *disk, uint32_t block_no, uint32_t hot, uint32_t nhot) {
+    struct bio_stats before, now;
+
+    bio_get_stats(&before);
+    do {
+        for (int i = 0; i < 16 && block_no < disk->sb->size; i++, block_no++) {
+            buf_release(buf_read(disk, block_no));
+        }
+        for (uint32_t bn = 0; bn < nhot; bn++) {
+            buf_release(buf_read(disk, hot + bn));
+        }
+        bio_get_stats(&now);
+    } while (now.evictions - before.evictions < 2 * bio_get_nbufs() &&
+             block_no < disk->sb->size);
+    return block_no;
+}
+
+/**
+ * Make a small set of blocks hot, scan through many blocks once and see
+ * how much of the hot set is still cached. Under 2Q a block is hot once it
+ * is read again after it left A1in, so the hot set is read again while a
+ * first scan pushes it out of A1in.
+ */
+static void buf_scan_test() {
+#define NHOT 8
+    struct disk *disk = get_current_disk();
+    uint32_t hot = disk->sb->bdata_start;
+    uint32_t scan = hot + 16384;
+    struct bio_stats before, after;
+
+    scan = scan_cache(disk, scan, hot, NHOT);
+    uint32_t start = scan;
+    scan = scan_cache(disk, scan, 0, 0);
+
+    bio_get_stats(&before);
+    for (uint32_t bn = 0; bn < NHOT; bn++) {
+        buf_release(buf_read(disk, hot + bn));
+    }
+    bio_get_stats(&after);
+
+    os_test_printf("%s: %d hot blocks after a scan of %d: %d hits; total %d hits, %d misses, "
+                   "%d evictions, %d ghost hits\n",
+                   bio_get_policy_name(), NHOT, scan - start, after.hits - before.hits, after.hits,
+                   after.misses, after.evictions, after.ghost_hits);
+    assert_int_equal(NHOT, after.lookups - before.lookups);
+    assert_true(after.evictions <= after.misses);
+    if (!strcmp(bio_get_policy_name(), "2Q")) {
+        // The hot set is in Am, the scan only goes through A1in.
+        assert_int_equal(NHOT, after.hits - before.hits);
+    }
+#undef NHOT
+}
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __cplusplus */
@@ -7,7 +7,10 @@
 #include "fs/log.h"
 #include "fs/pathname.h"
 
+#include "kernel/buf.h"
+#include "kernel/iosched.h"
 #include "kernel/memory.h"
+#include "kernel/task.h"
 #include "kernel/x86.h"
 
 #include "stdio.h"
@@ -20,16 +23,48 @@ extern "C" {
 #endif /* __cplusplus */
 
 static void data_block_test();
+static void balloc_summary_test();
+static void balloc_goal_test();
 static void inode_test();
+static void inode_alloc_test();
+static void inode_orphan_test();
+static void inode_cache_test();
+static void inode_large_test();
+static void inode_extent_test();
+static void inode_extent_index_test();
 static void inode_rw_test();
 static void dir_test();
+static void log_group_commit_test();
+static void log_checkpoint_test();
+static void log_commit_writes_test();
+static void log_budget_test();
+static void log_absorb_test();
+static void log_ordered_test();
+static void log_pipeline_test();
+static void log_recovery_test();
 
 void fs_test() {
     test_task_t tasks[] = {
         CREATE_TEST_TASK(dir_test),
         CREATE_TEST_TASK(data_block_test),
+        CREATE_TEST_TASK(balloc_summary_test),
+        CREATE_TEST_TASK(balloc_goal_test),
         CREATE_TEST_TASK(inode_test),
+        CREATE_TEST_TASK(inode_alloc_test),
+        CREATE_TEST_TASK(inode_orphan_test),
+        CREATE_TEST_TASK(inode_cache_test),
+        CREATE_TEST_TASK(inode_large_test),
+        CREATE_TEST_TASK(inode_extent_test),
+        CREATE_TEST_TASK(inode_extent_index_test),
         CREATE_TEST_TASK(inode_rw_test),
+        CREATE_TEST_TASK(log_group_commit_test),
+        CREATE_TEST_TASK(log_checkpoint_test),
+        CREATE_TEST_TASK(log_commit_writes_test),
+        CREATE_TEST_TASK(log_budget_test),
+        CREATE_TEST_TASK(log_absorb_test),
+        CREATE_TEST_TASK(log_ordered_test),
+        CREATE_TEST_TASK(log_pipeline_test),
+        CREATE_TEST_TASK(log_recovery_test),
     };
 
     os_test_run(tasks, sizeof(tasks) / sizeof(test_task_t));
@@ -37,7 +72,7 @@ void fs_test() {
 
 static void data_block_test() {
 
-    extern uint32_t balloc(struct disk * disk);
+    extern uint32_t balloc(struct disk * disk, uint32_t goal);
     extern void bfree(struct disk * disk, uint32_t block_no);
 
     struct disk *disk = get_current_disk();
@@ -48,9 +83,9 @@ static void data_block_test() {
 #define DBLOCK_N 16
     uint32_t *block_nos = kalloc(sizeof(uint32_t) * DBLOCK_N);
 
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
     for (int i = 0; i < DBLOCK_N; i++) {
-        block_nos[i] = balloc(disk);
+        block_nos[i] = balloc(disk, 0);
         assert_true(block_nos[i] >= disk->sb->bdata_start);
         if (i != 0) {
             assert_true(block_nos[i] > block_nos[i - 1]);
@@ -66,7 +101,7 @@ static void data_block_test() {
     assert_int_equal(free_dblocks - DBLOCK_N / 2, get_free_data_blocks(disk));
 
     for (int i = 0; i < DBLOCK_N / 2; i++) {
-        assert_int_equal(block_nos[i], balloc(disk));
+        assert_int_equal(block_nos[i], balloc(disk, 0));
     }
 
     assert_int_equal(free_dblocks - DBLOCK_N, get_free_data_blocks(disk));
@@ -82,6 +117,53 @@ static void data_block_test() {
 #undef DBLOCK_N
 }
 
+/**
+ * The free data blocks kept in memory match the bitmap.
+ */
+static void balloc_summary_test() {
+    struct disk *disk = get_current_disk();
+    struct superblock *sb = disk->sb;
+    uint32_t free_dblocks = 0;
+
+    uint32_t bmap_bits = sb->bmap_bytes * 8;
+    for (uint32_t bn = sb->bmap_start; bmap_bits > 0; bn++) {
+        uint32_t bits = bmap_bits < BITS_PER_BLOCK ? bmap_bits : BITS_PER_BLOCK;
+        struct buf *buf = buf_read(disk, bn);
+        for (uint32_t bit = 0; bit < bits; bit++) {
+            if ((buf->data[bit / 8] & (1 << (bit % 8))) == 0) {
+                free_dblocks++;
+            }
+        }
+        buf_release(buf);
+        bmap_bits -= bits;
+    }
+    assert_int_equal(free_dblocks, get_free_data_blocks(disk));
+}
+
+static void balloc_goal_test() {
+    extern uint32_t balloc(struct disk * disk, uint32_t goal);
+    extern void bfree(struct disk * disk, uint32_t block_no);
+
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    uint32_t first = balloc(disk, 0);
+    uint32_t second = balloc(disk, first + 1);
+
+    // The goal is taken when it is free, else the next free block after it.
+    bfree(disk, first);
+    assert_int_equal(first, balloc(disk, first));
+    assert_int_equal(first + 1, second);
+    uint32_t next = balloc(disk, second);
+    assert_true(next > second);
+
+    bfree(disk, next);
+    bfree(disk, second);
+    bfree(disk, first);
+    log_end_op(log);
+}
+
 static void inode_test() {
 
     struct inode *ip;
@@ -99,7 +181,7 @@ static void inode_test() {
     assert_ptr_not_equal(NULL, ips);
     free_inodes = get_free_inodes(disk);
 
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
     for (int i = 0; i < NIPS; i++) {
         ips[i] = ip = inode_alloc(disk, INODE_FILE);
         inode_lock(ip);
@@ -114,7 +196,7 @@ static void inode_test() {
 
     assert_int_equal(free_inodes - NIPS, get_free_inodes(disk));
 
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
     for (int i = 0; i < NIPS; i++) {
         inode_unlock(ips[i]);
         inode_put(ips[i]);
@@ -128,6 +210,307 @@ static void inode_test() {
     INT_UNLOCK(int_save);
 }
 
+/**
+ * The inode bitmap matches the inode table, and an allocation reads a
+ * constant number of blocks.
+ */
+static void inode_alloc_test() {
+    struct disk *disk = get_current_disk();
+    struct superblock *sb = disk->sb;
+    struct log *log = disk->log;
+    struct bio_stats before, after;
+    uint32_t free_inodes = 0;
+
+    // inum = 1: inum 0 is the NULL inode.
+    for (uint32_t inum = 1; inum < sb->ninodes; inum++) {
+        struct buf *buf = buf_read(disk, GET_INODE_BLOCK_NO(inum, *sb));
+        struct dinode *dip = (struct dinode *) buf->data + (inum % INODES_PER_BLOCK);
+        if (dip->type == INODE_NONE) {
+            free_inodes++;
+        }
+        buf_release(buf);
+    }
+    assert_int_equal(free_inodes, get_free_inodes(disk));
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    bio_get_stats(&before);
+    struct inode *ip = inode_alloc(disk, INODE_FILE);
+    bio_get_stats(&after);
+    // The inode bitmap block and the inode block.
+    assert_int_equal(before.lookups + 2, after.lookups);
+    assert_int_equal(free_inodes - 1, get_free_inodes(disk));
+    inode_lock(ip);
+    inode_unlockput(ip);
+    log_end_op(log);
+
+    assert_int_equal(free_inodes, get_free_inodes(disk));
+}
+
+/**
+ * An unlinked inode left on the disk, as by a crash before inode_reclaim(),
+ * is freed with its blocks at mount.
+ */
+static void inode_orphan_test() {
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t free_inodes = get_free_inodes(disk);
+    uint32_t free_dblocks = get_free_data_blocks(disk);
+    char data[] = "orphan";
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    struct inode *ip = inode_alloc(disk, INODE_FILE);
+    inode_lock(ip);
+    assert_int_equal(0, ip->disk_inode.nlink);
+    assert_int_equal(sizeof data, inode_write(ip, data, 0, sizeof data));
+    // Forget the inode in memory, the last inode_put() does not free it.
+    ip->valid = false;
+    inode_unlockput(ip);
+    log_end_op(log);
+    log_force(log);
+    assert_int_equal(free_inodes - 1, get_free_inodes(disk));
+    assert_true(get_free_data_blocks(disk) < free_dblocks);
+
+    inode_reclaim_orphans(disk);
+    assert_int_equal(free_inodes, get_free_inodes(disk));
+    assert_int_equal(free_dblocks, get_free_data_blocks(disk));
+}
+
+static void inode_cache_test() {
+    extern struct inode *iget(struct disk * disk, uint32_t inum);
+
+    struct disk *disk = get_current_disk();
+    struct icache_stats before, after;
+    struct inode *ip;
+
+    // An unreferenced inode keeps its disk inode.
+    ip = iget(disk, ROOT_INUM);
+    inode_lock(ip);
+    inode_unlockput(ip);
+    icache_get_stats(&before);
+    assert_ptr_equal(ip, iget(disk, ROOT_INUM));
+    assert_true(ip->valid);
+    icache_get_stats(&after);
+    assert_int_equal(before.hits + 1, after.hits);
+    assert_int_equal(before.reuses + 1, after.reuses);
+    inode_put(ip);
+
+    // More inodes than the initial cache can be referenced at once.
+#define NIPS 120
+    struct inode **ips = kalloc(sizeof(*ips) * NIPS);
+    for (int i = 0; i < NIPS; i++) {
+        ips[i] = iget(disk, ROOT_INUM + 1 + i);
+    }
+    icache_get_stats(&after);
+    assert_true(after.ninodes >= NIPS);
+    os_test_printf("%d cached inodes: %d lookups, %d hits, %d reuses\n", after.ninodes,
+                   after.lookups, after.hits, after.reuses);
+    for (int i = 0; i < NIPS; i++) {
+        inode_put(ips[i]);
+    }
+    kfree(ips);
+#undef NIPS
+}
+
+/**
+ * Write a file into its double indirect tree and free it again.
+ */
+static void inode_large_test() {
+#define CHUNK_BLOCKS (PG_SIZE / BLOCK_SIZE)
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t nblocks =
+        (ROUND_UP(NDIRECT_DATA_BLOCKS + NINDIRECT_DATA_BLOCKS, CHUNK_BLOCKS) + 1) * CHUNK_BLOCKS;
+    uint32_t free_dblocks = get_free_data_blocks(disk);
+    char *data = get_free_page();
+    struct inode *ip;
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    ip = inode_alloc(disk, INODE_FILE);
+    inode_lock(ip);
+    inode_unlock(ip);
+    log_end_op(log);
+
+    for (uint32_t bn = 0; bn < nblocks; bn += CHUNK_BLOCKS) {
+        memset(data, bn & 0xff, CHUNK_BLOCKS * BLOCK_SIZE);
+        log_begin_op(log, LOG_BUDGET_WRITE);
+        inode_lock(ip);
+        assert_int_equal(CHUNK_BLOCKS * BLOCK_SIZE,
+                         inode_write(ip, data, bn * BLOCK_SIZE, CHUNK_BLOCKS * BLOCK_SIZE));
+        inode_unlock(ip);
+        log_end_op(log);
+    }
+
+    inode_lock(ip);
+    assert_int_equal(nblocks * BLOCK_SIZE, ip->disk_inode.size);
+    assert_true(ip->disk_inode.addrs[NDIRECT_DATA_BLOCKS + 1] != 0);
+    inode_read(ip, data, (nblocks - 1) * BLOCK_SIZE, BLOCK_SIZE);
+    assert_int_equal((nblocks - CHUNK_BLOCKS) & 0xff, (uint8_t) data[BLOCK_SIZE - 1]);
+    inode_unlock(ip);
+
+    // The data blocks, one single and two double indirect blocks are used.
+    assert_int_equal(free_dblocks - nblocks - 3, get_free_data_blocks(disk));
+
+    log_begin_op(log, LOG_BUDGET_PUT);
+    inode_put(ip);
+    log_end_op(log);
+    assert_int_equal(free_dblocks, get_free_data_blocks(disk));
+
+    free_page(data);
+#undef CHUNK_BLOCKS
+}
+
+/**
+ * Return the disk block following the last extent of @ip.
+ */
+static uint32_t extent_end(struct inode *ip) {
+    struct dinode *dp = &ip->disk_inode;
+    struct extent *ext = dp->extents;
+    uint32_t n = dp->nextents;
+    struct buf *buf = NULL, *ibuf = NULL;
+
+    if (dp->flags & INODE_FLAGS_EINDEX) {
+        ibuf = buf_read(ip->disk, dp->eblock);
+        struct extent *idx = (struct extent *) ibuf->data + n - 1;
+        n = idx->len;
+        buf = buf_read(ip->disk, idx->pblock);
+    } else if (dp->eblock != 0) {
+        buf = buf_read(ip->disk, dp->eblock);
+    }
+    if (buf != NULL) {
+        ext = (struct extent *) buf->data;
+    }
+    uint32_t end = ext[n - 1].pblock + ext[n - 1].len;
+    if (buf != NULL) {
+        buf_release(buf);
+    }
+    if (ibuf != NULL) {
+        buf_release(ibuf);
+    }
+    return end;
+}
+
+/**
+ * An extent-mapped inode maps a sequential write with one extent and moves
+ * its extents to an extent block when the file fragments.
+ */
+static void inode_extent_test() {
+#define NBLOCKS  (PG_SIZE / BLOCK_SIZE)
+#define NBLOCKED (NINODE_EXTENTS + 2)
+    extern uint32_t balloc(struct disk * disk, uint32_t goal);
+    extern void bfree(struct disk * disk, uint32_t block_no);
+
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t free_dblocks = get_free_data_blocks(disk);
+    uint32_t blocked[NBLOCKED];
+    char *data = get_free_page();
+    struct inode *ip;
+
+    log_begin_op(log, LOG_BUDGET_WRITE);
+    ip = inode_alloc(disk, INODE_FILE);
+    inode_lock(ip);
+    ip->disk_inode.flags = INODE_FLAGS_EXTENTS;
+    inode_update(ip);
+
+    memset(data, 0x3c, NBLOCKS * BLOCK_SIZE);
+    assert_int_equal(NBLOCKS * BLOCK_SIZE, inode_write(ip, data, 0, NBLOCKS * BLOCK_SIZE));
+    uint32_t mapped = 0;
+    for (uint32_t i = 0; i < ip->disk_inode.nextents; i++) {
+        mapped += ip->disk_inode.extents[i].len;
+    }
+    os_test_printf("%d blocks written sequentially: %d extents\n", NBLOCKS,
+                   ip->disk_inode.nextents);
+    assert_int_equal(NBLOCKS, mapped);
+    log_end_op(log);
+
+    // Take the block following the file before each append.
+    for (int i = 0; i < NBLOCKED; i++) {
+        log_begin_op(log, LOG_BUDGET_WRITE);
+        uint32_t bn = ip->disk_inode.size / BLOCK_SIZE;
+        blocked[i] = balloc(disk, extent_end(ip));
+        memset(data, i, BLOCK_SIZE);
+        assert_int_equal(BLOCK_SIZE, inode_write(ip, data, bn * BLOCK_SIZE, BLOCK_SIZE));
+        log_end_op(log);
+    }
+    assert_true(ip->disk_inode.nextents > NINODE_EXTENTS);
+    assert_true(ip->disk_inode.eblock != 0);
+
+    inode_read(ip, data, 0, BLOCK_SIZE);
+    assert_int_equal(0x3c, data[0]);
+    inode_read(ip, data, (NBLOCKS + NBLOCKED - 1) * BLOCK_SIZE, BLOCK_SIZE);
+    assert_int_equal(NBLOCKED - 1, data[0]);
+    inode_unlock(ip);
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    inode_put(ip);
+    for (int i = 0; i < NBLOCKED; i++) {
+        bfree(disk, blocked[i]);
+    }
+    log_end_op(log);
+    assert_int_equal(free_dblocks, get_free_data_blocks(disk));
+
+    free_page(data);
+#undef NBLOCKED
+#undef NBLOCKS
+}
+
+/**
+ * An extent-mapped inode whose extent block is full goes on with an index
+ * of extent blocks.
+ */
+static void inode_extent_index_test() {
+#define NBLOCKS (NBLOCK_EXTENTS + 2)
+    extern uint32_t balloc(struct disk * disk, uint32_t goal);
+    extern void bfree(struct disk * disk, uint32_t block_no);
+
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t free_dblocks = get_free_data_blocks(disk);
+    uint32_t *blocked = get_free_page();
+    char *data = get_free_page();
+    struct inode *ip;
+
+    log_begin_op(log, LOG_BUDGET_WRITE);
+    ip = inode_alloc(disk, INODE_FILE);
+    inode_lock(ip);
+    ip->disk_inode.flags = INODE_FLAGS_EXTENTS;
+    memset(data, 0, BLOCK_SIZE);
+    assert_int_equal(BLOCK_SIZE, inode_write(ip, data, 0, BLOCK_SIZE));
+    log_end_op(log);
+
+    // Take the block following the file before each append, every block
+    // is a new extent.
+    for (uint32_t bn = 1; bn <= NBLOCKS; bn++) {
+        log_begin_op(log, LOG_BUDGET_WRITE);
+        blocked[bn - 1] = balloc(disk, extent_end(ip));
+        memset(data, bn & 0xff, BLOCK_SIZE);
+        assert_int_equal(BLOCK_SIZE, inode_write(ip, data, bn * BLOCK_SIZE, BLOCK_SIZE));
+        log_end_op(log);
+    }
+    assert_true((ip->disk_inode.flags & INODE_FLAGS_EINDEX) != 0);
+    assert_int_equal(2, ip->disk_inode.nextents);
+    assert_int_equal((NBLOCKS + 1) * BLOCK_SIZE, ip->disk_inode.size);
+
+    // The blocks of both extent blocks are mapped.
+    for (uint32_t bn = 1; bn <= NBLOCKS; bn += NBLOCKS - 1) {
+        inode_read(ip, data, bn * BLOCK_SIZE, BLOCK_SIZE);
+        assert_int_equal(bn & 0xff, (uint8_t) data[BLOCK_SIZE - 1]);
+    }
+    inode_unlock(ip);
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    inode_put(ip);
+    for (uint32_t i = 0; i < NBLOCKS; i++) {
+        bfree(disk, blocked[i]);
+    }
+    log_end_op(log);
+    assert_int_equal(free_dblocks, get_free_data_blocks(disk));
+
+    free_page(data);
+    free_page(blocked);
+#undef NBLOCKS
+}
+
 static void inode_rw_test() {
     struct inode *ip;
 
@@ -144,7 +527,7 @@ static void inode_rw_test() {
     char *buf = get_free_page();
     data[DATA_SIZE] = buf[DATA_SIZE] = '\0';
 
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
 
     ip = inode_alloc(disk, INODE_FILE);
     inode_lock(ip);
@@ -183,7 +566,7 @@ static struct inode *inc_dir(struct inode *dir, char *name) {
     struct disk *disk = get_current_disk();
     struct log *log = disk->log;
 
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
     ip = inode_alloc(get_current_disk(), INODE_FILE);
     inode_lock(ip);
     assert_ptr_not_equal(NULL, ip);
@@ -212,7 +595,7 @@ static void dir_test() {
 
     free_dblocks = get_free_data_blocks(disk);
 
-    log_begin_op(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
     dir = inode_alloc(disk, INODE_DIRECTORY);
     inode_lock(dir);
 
@@ -249,6 +632,498 @@ static void dir_test() {
 #undef DIREN_SIZE
 }
 
+static void log_group_commit_test() {
+#define NOPS 8
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+
+    log_force(log);
+    uint32_t commits = log->commits;
+
+    // Small operations in a row share a transaction.
+    for (int i = 0; i < NOPS; i++) {
+        log_begin_op(log, LOG_BUDGET_MAX);
+        struct buf *buf = buf_read(disk, disk->sb->bdata_start);
+        log_write(log, buf);
+        buf_release(buf);
+        log_end_op(log);
+    }
+
+    log_force(log);
+    assert_int_equal(0, log->lh->n);
+    assert_true(log->commits - commits >= 1);
+    assert_true(log->commits - commits < NOPS);
+#undef NOPS
+}
+
+/**
+ * Committed transactions stay in the log until it is 1 / LOG_CHECKPOINT_RATIO
+ * full.
+ */
+static void log_checkpoint_test() {
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t checkpoints = log->checkpoints;
+    struct buf *buf;
+
+    for (uint32_t i = 0; i < log->size && log->checkpoints == checkpoints; i++) {
+        uint32_t head = log->head;
+        uint32_t seq = log->seq;
+
+        log_begin_op(log, LOG_BUDGET_MAX);
+        buf = buf_read(disk, disk->sb->bdata_start + i);
+        log_write(log, buf);
+        buf_release(buf);
+        log_end_op(log);
+        log_force(log);
+
+        // A descriptor, a data block and a commit block are appended.
+        assert_int_equal(seq + 1, log->seq);
+        buf = buf_read(disk, log->log_start + 1 + head);
+        struct log_desc *desc = (struct log_desc *) buf->data;
+        assert_int_equal(LOG_DESC_MAGIC, desc->magic);
+        assert_int_equal(seq, desc->seq);
+        assert_int_equal(1, desc->n);
+        buf_release(buf);
+
+        if (log->checkpoints == checkpoints) {
+            // The transaction is kept in the log.
+            assert_int_equal((head + 3) % log->size, log->head);
+            assert_true(log->used > 0);
+        }
+    }
+    assert_true(log->checkpoints > checkpoints);
+    assert_true(log->used < log->size / LOG_CHECKPOINT_RATIO);
+
+    // The tail is durable.
+    buf = buf_read(disk, log->log_start);
+    struct log_super *super = (struct log_super *) buf->data;
+    assert_int_equal(LOG_MAGIC, super->magic);
+    assert_int_equal(log->tail, super->tail);
+    assert_int_equal(log->tail_seq, super->seq);
+    buf_release(buf);
+}
+
+/**
+ * A commit writes its blocks to the log only, the home blocks are delayed
+ * until the checkpoint.
+ */
+static void log_commit_writes_test() {
+    extern uint32_t balloc(struct disk * disk, uint32_t goal);
+    extern void bfree(struct disk * disk, uint32_t block_no);
+
+#define NBLOCKS 4
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    struct iosched *sched = iosched_get_current();
+    struct iosched_stats before, after;
+    uint32_t blocks[NBLOCKS];
+    struct buf *buf;
+    bool checked = false;
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    for (int i = 0; i < NBLOCKS; i++) {
+        blocks[i] = balloc(disk, 0);
+    }
+    log_end_op(log);
+    log_force(log);
+
+    // A commit followed by a checkpoint writes the home blocks, the one
+    // after it does not.
+    for (int n = 0; n < 2 && !checked; n++) {
+        uint32_t checkpoints = log->checkpoints;
+        iosched_get_stats(sched, &before);
+        log_begin_op(log, LOG_BUDGET_MAX);
+        for (int i = 0; i < NBLOCKS; i++) {
+            buf = buf_read(disk, blocks[i]);
+            memset(buf->data, n + 1, BLOCK_SIZE);
+            log_write(log, buf);
+            buf_release(buf);
+        }
+        log_end_op(log);
+        log_force(log);
+        iosched_get_stats(sched, &after);
+
+        if (log->checkpoints != checkpoints) {
+            continue;
+        }
+        checked = true;
+#ifndef KERNEL_WRITEBACK
+        // The descriptor, the blocks and the commit block.
+        assert_int_equal(NBLOCKS + 2, after.write_blocks - before.write_blocks);
+        for (int i = 0; i < NBLOCKS; i++) {
+            buf = buf_read(disk, blocks[i]);
+            assert_true((buf->flags & BUF_FLAGS_DELWRI) != 0);
+            buf_release(buf);
+        }
+#endif
+    }
+    assert_true(checked);
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    for (int i = 0; i < NBLOCKS; i++) {
+        bfree(disk, blocks[i]);
+    }
+    log_end_op(log);
+    log_force(log);
+#undef NBLOCKS
+}
+
+static void log_budget_test() {
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    struct buf *buf;
+
+    log_force(log);
+    uint32_t overruns = log->overruns;
+    int reserved = log->reserved;
+
+    log_begin_op(log, LOG_BUDGET_PUT);
+    assert_int_equal(LOG_BUDGET_PUT, log_budget_left(log));
+    assert_int_equal(reserved + LOG_BUDGET_PUT, log->reserved);
+
+    // A block is charged once, however many times it is written.
+    for (int i = 0; i < 2; i++) {
+        buf = buf_read(disk, disk->sb->bdata_start);
+        log_write(log, buf);
+        buf_release(buf);
+        assert_int_equal(LOG_BUDGET_PUT - 1, log_budget_left(log));
+    }
+    log_end_op(log);
+    assert_int_equal(reserved, log->reserved);
+    assert_int_equal(overruns, log->overruns);
+
+    // An operation over its budget is counted.
+    log_begin_op(log, 0);
+    buf = buf_read(disk, disk->sb->bdata_start + 1);
+    log_write(log, buf);
+    buf_release(buf);
+    log_end_op(log);
+    assert_int_equal(overruns + 1, log->overruns);
+    log_force(log);
+}
+
+static void log_absorb_test() {
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t base = disk->sb->bdata_start;
+    struct buf *buf;
+
+    log_force(log);
+    log_begin_op(log, LOG_BUDGET_WRITE);
+    int nblocks = log_budget_left(log);
+    int n = log->lh->n;
+
+    // Every block is in the transaction once, however many times it is written.
+    for (int r = 0; r < 3; r++) {
+        for (int i = 0; i < nblocks; i++) {
+            buf = buf_read(disk, base + i);
+            log_write(log, buf);
+            assert_ptr_equal(buf, log->lh->bufs[n + i]);
+            buf_release(buf);
+        }
+        assert_int_equal(n + nblocks, log->lh->n);
+        assert_int_equal(0, log_budget_left(log));
+    }
+    log_end_op(log);
+    log_force(log);
+}
+
+static void log_ordered_test() {
+    extern uint32_t balloc_data(struct disk * disk, uint32_t goal);
+    extern void bfree(struct disk * disk, uint32_t block_no);
+
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    struct iosched_stats before, after;
+    struct buf *buf;
+
+    if (!log->ordered) {
+        return;
+    }
+
+    log_force(log);
+    log_begin_op(log, LOG_BUDGET_MAX);
+    iosched_get_stats(iosched_get_current(), &before);
+    int ndata = log->lh->ndata;
+    uint32_t block_no = balloc_data(disk, 0);
+    assert_true(log_block_reusable(log, block_no));
+    int n = log->lh->n;
+
+    // The new block is zeroed in the cache, without a write.
+    iosched_get_stats(iosched_get_current(), &after);
+    assert_int_equal(before.write_blocks, after.write_blocks);
+    assert_int_equal(ndata, log->lh->ndata);
+    buf = buf_read(disk, block_no);
+    assert_true((buf->flags & BUF_FLAGS_DELWRI) != 0);
+    assert_int_equal(0, buf->data[0]);
+    buf_release(buf);
+
+    // The data block is written in place, not logged.
+    buf = buf_read(disk, block_no);
+    memset(buf->data, 0x5a, BLOCK_SIZE);
+    log_write_data(log, buf);
+    assert_int_equal(0, buf->flags & BUF_FLAGS_DIRTY);
+    buf_release(buf);
+    assert_int_equal(n, log->lh->n);
+    assert_int_equal(block_no, log->lh->data[log->lh->ndata - 1]);
+
+    // A freed block is not written in place until the next checkpoint.
+    bfree(disk, block_no);
+    assert_false(log_block_reusable(log, block_no));
+    log_end_op(log);
+    log_force(log);
+
+    // The commit wrote the data block.
+    buf = buf_read(disk, block_no);
+    assert_int_equal(0, buf->flags & (BUF_FLAGS_DIRTY | BUF_FLAGS_DELWRI));
+    assert_int_equal(0x5a, buf->data[0]);
+    buf_release(buf);
+}
+
+static void log_op_thread(void *arg) {
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t block_no = (uint32_t) arg;
+
+    for (int i = 0; i < 20; i++) {
+        log_begin_op(log, LOG_BUDGET_PUT);
+        struct buf *buf = buf_read(disk, block_no);
+        log_write(log, buf);
+        buf_release(buf);
+        log_end_op(log);
+        log_force(log);
+    }
+}
+
+static void log_force_thread(void *arg) {
+    log_force((struct log *) arg);
+}
+
+/**
+ * Operations of several threads forcing the log keep committing, while
+ * the others begin operations during the commits.
+ */
+static void log_pipeline_test() {
+    extern uint32_t balloc(struct disk * disk, uint32_t goal);
+    extern void bfree(struct disk * disk, uint32_t block_no);
+
+#define NTHREADS 4
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t blocks[NTHREADS + 1];
+    struct buf *buf;
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    for (int i = 0; i <= NTHREADS; i++) {
+        blocks[i] = balloc(disk, 0);
+    }
+    log_end_op(log);
+
+    uint32_t commits = log->commits;
+    uint32_t overlaps = log->overlaps;
+
+    for (int i = 0; i < NTHREADS; i++) {
+        kthread_start(log_op_thread, (void *) blocks[i], 10, "log_op_thread%d", i);
+    }
+    for (;;) {
+        if (task_wait(NULL) == -1)
+            break;
+    }
+
+    // Begin an operation right after a transaction is closed, it joins the
+    // next transaction while the closed one is being written. A commit with a
+    // checkpoint stops the new operations, so try a few times.
+    for (int i = 0; i < 8 && log->overlaps == overlaps; i++) {
+        log_begin_op(log, LOG_BUDGET_PUT);
+        buf = buf_read(disk, blocks[NTHREADS]);
+        log_write(log, buf);
+        buf_release(buf);
+        log_end_op(log);
+
+        uint32_t closed = log->closed;
+        kthread_start(log_force_thread, log, 10, "log_force_thread");
+        while (log->closed == closed) {
+            task_yield();
+        }
+        log_begin_op(log, LOG_BUDGET_PUT);
+        log_end_op(log);
+        task_wait(NULL);
+    }
+
+    os_test_printf("%d commits, %d operations begun during a commit\n", log->commits - commits,
+                   log->overlaps - overlaps);
+    assert_true(log->commits - commits >= 1);
+    assert_true(log->overlaps - overlaps > 0);
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    for (int i = 0; i <= NTHREADS; i++) {
+        bfree(disk, blocks[i]);
+    }
+    log_end_op(log);
+    log_force(log);
+    assert_int_equal(log->closed, log->commits);
+    assert_int_equal(0, log->lh->n);
+#undef NTHREADS
+}
+
+/**
+ * Fill the block @block_no with @c on the disk.
+ */
+static void fill_block(struct disk *disk, uint32_t block_no, uint8_t c) {
+    struct buf *buf = buf_overwrite(disk, block_no);
+    memset(buf->data, c, BLOCK_SIZE);
+    assert_int_equal(0, buf_write(buf));
+    buf_release(buf);
+}
+
+/**
+ * Write a transaction of sequence @seq at the offset @pos of the log area
+ * of @size blocks from @area, its blocks @homes are filled with @c. A torn
+ * transaction gets a commit block left from an older lap.
+ */
+static void write_log_trans(struct disk *disk, uint32_t area, uint32_t size, uint32_t pos,
+                            uint32_t seq, uint32_t *homes, uint32_t n, uint8_t c, bool commit) {
+    struct buf *buf = buf_overwrite(disk, area + pos % size);
+    struct log_desc *desc = (struct log_desc *) buf->data;
+    memset(desc, 0, BLOCK_SIZE);
+    desc->magic = LOG_DESC_MAGIC;
+    desc->seq = seq;
+    desc->n = n;
+    for (uint32_t i = 0; i < n; i++) {
+        desc->blocks[i] = homes[i];
+    }
+    assert_int_equal(0, buf_write(buf));
+    buf_release(buf);
+
+    for (uint32_t i = 0; i < n; i++) {
+        fill_block(disk, area + (pos + i + 1) % size, c);
+    }
+
+    buf = buf_overwrite(disk, area + (pos + n + 1) % size);
+    struct log_commit *rec = (struct log_commit *) buf->data;
+    memset(rec, 0, BLOCK_SIZE);
+    rec->magic = LOG_COMMIT_MAGIC;
+    rec->seq = commit ? seq : seq - size;
+    rec->n = n;
+    assert_int_equal(0, buf_write(buf));
+    buf_release(buf);
+}
+
+/**
+ * Write the log super block of the log from @log_start.
+ */
+static void write_log_super(struct disk *disk, uint32_t log_start, uint32_t tail, uint32_t seq) {
+    struct buf *buf = buf_overwrite(disk, log_start);
+    struct log_super *super = (struct log_super *) buf->data;
+    memset(super, 0, BLOCK_SIZE);
+    super->magic = LOG_MAGIC;
+    super->tail = tail;
+    super->seq = seq;
+    assert_int_equal(0, buf_write(buf));
+    buf_release(buf);
+}
+
+/**
+ * Assert that the block @block_no is filled with @c.
+ */
+static void assert_block(struct disk *disk, uint32_t block_no, uint8_t c) {
+    struct buf *buf = buf_read(disk, block_no);
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        assert_int_equal(c, buf->data[i]);
+    }
+    buf_release(buf);
+}
+
+/**
+ * Recover a log area of the test: a committed transaction is installed,
+ * the torn one after it is not, also when the area wraps around.
+ */
+static void log_recovery_test() {
+    extern uint32_t balloc(struct disk * disk, uint32_t goal);
+    extern void bfree(struct disk * disk, uint32_t block_no);
+
+#define NLOG   17 // The log super block and a circular area of 16 blocks.
+#define NHOMES 5
+    struct disk *disk = get_current_disk();
+    struct log *log = disk->log;
+    uint32_t log_start, area, size = NLOG - 1;
+    uint32_t homes[NHOMES];
+    struct log *tlog = kalloc(sizeof(struct log));
+
+    // The log area must be contiguous.
+    log_begin_op(log, LOG_BUDGET_MAX);
+    log_start = balloc(disk, 0);
+    for (uint32_t i = 1; i < NLOG; i++) {
+        assert_int_equal(log_start + i, balloc(disk, log_start + i));
+    }
+    for (int i = 0; i < NHOMES; i++) {
+        homes[i] = balloc(disk, 0);
+    }
+    log_end_op(log);
+    log_force(log);
+    area = log_start + 1;
+
+    // Transaction 5 at the tail is committed, transaction 6 is torn.
+    for (int i = 0; i < NHOMES; i++) {
+        fill_block(disk, homes[i], 0);
+    }
+    write_log_trans(disk, area, size, 0, 5, homes, 2, 0xa5, true);
+    write_log_trans(disk, area, size, 4, 6, homes + 2, 1, 0xa6, false);
+    write_log_super(disk, log_start, 0, 5);
+
+    log_open(tlog, disk, log_start, NLOG);
+    assert_int_equal(4, tlog->head);
+    assert_int_equal(6, tlog->seq);
+    assert_int_equal(4, tlog->tail);
+    assert_block(disk, homes[0], 0xa5);
+    assert_block(disk, homes[1], 0xa5);
+    assert_block(disk, homes[2], 0);
+    kfree(tlog->lh);
+    kfree(tlog->clh);
+
+    // Transaction 10 wraps around the end of the area, transaction 11 is
+    // torn after it.
+    for (int i = 0; i < NHOMES; i++) {
+        fill_block(disk, homes[i], 0);
+    }
+    write_log_trans(disk, area, size, 12, 10, homes, 3, 0xb0, true);
+    write_log_trans(disk, area, size, 1, 11, homes + 3, 2, 0xb1, false);
+    write_log_super(disk, log_start, 12, 10);
+
+    log_open(tlog, disk, log_start, NLOG);
+    assert_int_equal(1, tlog->head);
+    assert_int_equal(11, tlog->seq);
+    for (int i = 0; i < 3; i++) {
+        assert_block(disk, homes[i], 0xb0);
+    }
+    assert_block(disk, homes[3], 0);
+    assert_block(disk, homes[4], 0);
+    kfree(tlog->lh);
+    kfree(tlog->clh);
+
+    // The checkpoint of the recovery moved the tail, nothing is replayed again.
+    fill_block(disk, homes[0], 0);
+    log_open(tlog, disk, log_start, NLOG);
+    assert_int_equal(1, tlog->tail);
+    assert_block(disk, homes[0], 0);
+    kfree(tlog->lh);
+    kfree(tlog->clh);
+    kfree(tlog);
+
+    log_begin_op(log, LOG_BUDGET_MAX);
+    for (uint32_t i = 0; i < NLOG; i++) {
+        bfree(disk, log_start + i);
+    }
+    for (int i = 0; i < NHOMES; i++) {
+        bfree(disk, homes[i]);
+    }
+    log_end_op(log);
+    log_force(log);
+#undef NHOMES
+#undef NLOG
+}
+
 #ifdef __cplusplus
 #if __cplusplus
 }
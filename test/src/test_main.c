@@ -6,13 +6,14 @@
 extern void list_test();
 extern void mem_test();
 extern void fs_test();
+extern void bio_test();
 extern void pathname_test();
 extern void task_test();
 
 static void test_thread(void *__attribute__((unused)) data) {
     test_task_t tasks[] = {
         CREATE_TEST_TASK(list_test),     CREATE_TEST_TASK(mem_test), CREATE_TEST_TASK(task_test),
-        CREATE_TEST_TASK(pathname_test), CREATE_TEST_TASK(fs_test),
+        CREATE_TEST_TASK(pathname_test), CREATE_TEST_TASK(bio_test), CREATE_TEST_TASK(fs_test),
     };
     os_test_run(tasks, sizeof(tasks) / sizeof(test_task_t));
     for (;;) {
@@ -144,11 +144,11 @@ static void path_lookup_test() {
         struct path_record r;
         r.path = tc->mk_path;
         r.type = INODE_FILE;
-        log_begin_op(log);
+        log_begin_op(log, LOG_BUDGET_MAX);
         mkf(&r);
         log_end_op(log);
         while (*input != 0) {
-            log_begin_op(log);
+            log_begin_op(log, LOG_BUDGET_MAX);
             if (tc->nameiparent) {
                 ip = path_lookup_parent(get_current_disk(), *input, name);
                 assert_str_equal(tc->name, name);
@@ -164,7 +164,7 @@ static void path_lookup_test() {
             input++;
             log_end_op(log);
         }
-        log_begin_op(log);
+        log_begin_op(log, LOG_BUDGET_MAX);
         rmf(&r);
         log_end_op(log);
     }